@@ -7,27 +7,78 @@
 
 /* -------------------- Options -------------------- */
 #define DEBUG
-//#define USE_HEADER
+//#define NO_DEBUG_MAIN //Leave out the debug main when linked into another program
 #define USE_PREFIX
+#define USE_PROBES //USDT probes (provider gpmalloc) when sys/sdt.h is found, no-ops otherwise
+//#define USE_CONSTRUCTOR //Set up before main, mem_config then has no effect
 
-//Locks
+//Locks, futex on linux unless spin or pthread is chosen
 #define USE_LOCK
 //#define USE_LOCK_SPIN
+//#define USE_LOCK_PTHREAD
+#define LOCK_SPIN 64 //Tries before parking on the futex
+#define LOCK_BACKOFF_MAX 1024 //Most pause instructions between tries
 
-//Tree table
+//Tree table, sizes up to TABLE_SIZE are served by size classes
 #define TABLE_SIZE 4096
+#define CLASS_STEP 8 //Class granularity in bytes
+#define CLASS_WASTE_DEFAULT 0.125 //Internal fragmentation target when deriving classes
+#define USE_HISTOGRAM
 
 //Defult Pagesize
 #define PAGESIZE_DEFAULT 4096
 #define PAGE_MIN_ALLOC 1
 
+//Default backend, sbrk heap or mmap segments
 #define USE_SBRK
 
+//Runtime defaults, can be changed with GPMALLOC_CONF (see config_parse)
+#define CONFIG_ENV "GPMALLOC_CONF"
+#define MMAP_THRESHOLD (128 * 1024) //Blocks >= this get their own mapping
+#define DECAY_TIME 0 //ms free heap top is kept before it is trimmed, -1 never
+#define ARENA_COUNT 4 //Main arena and one per lifetime hint, 1 serves hints from the main arena
+#define CACHE_SIZE 32 //Blocks kept per bin in a thread cache, 0 for none
+#define FAST_MAX 256 //Frees of blocks <= this are joined later, 0 joins at once
+#define FAST_LIMIT (1024 * 1024) //Bytes waiting to be joined before all are joined
+#define HEADROOM 0 //Free bytes kept pre-faulted on top of the heap when it grows or is trimmed
+#define PREWARM 0 //Bytes faulted in on top of the heap once set up, 0 for none
+#define PREWARM_BLOCKS 0 //Blocks cut per size class up to PREWARM_CLASS_MAX once set up, 0 for none
+#define PREWARM_CLASS_MAX 1024
+
+//Hint arenas (mem_alloc_flags)
+#define ARENA_HINT_MAP (256 * 1024) //Smallest mapping of a hint arena
+
+//Persistent arenas
+#define PERSIST_ADDRESS 0x500000000000 //Default address a new persistent region is mapped at
+#define PERSIST_SIZE (1024 * 1024 * 1024) //Default region size, the file is sparse
+
+//Shared arenas
+#define SHARED_SIZE (256 * 1024 * 1024) //Default size of a shared arena
+#define SHARED_WAIT 1000 //ms a process attaching waits for the creator to set the arena up
+
+//Compressed arenas
+#define COMPRESSED_SIZE (1024 * 1024 * 1024) //Default size of a compressed arena, reserved and faulted in as used
+
+//Object pools
+#define OBJPOOL_SLAB (64 * 1024) //Bytes per slab, larger for objects that would not fit OBJPOOL_SLAB_MIN
+#define OBJPOOL_SLAB_MIN 8 //Fewest objects per slab
+#define OBJPOOL_ALIGN 16 //Alignment when 0 is given
+
+//Background frees
+#define ASYNC_MIN 0 //Frees of blocks >= this (and of mapped blocks) are done by an allocator thread, 0 for none
+#define ASYNC_LIMIT (64 * 1024 * 1024) //Queued bytes past which frees are done inline again
+
+//Deferred frees (mem_free_deferred)
+#define EPOCH_BATCH 64 //Deferred frees between tries to advance the epoch, and per limbo bag
+
+//Calloc
+#define CALLOC_FRESH_MIN (1024 * 1024) //calloc >= this is taken from fresh pages
+#define ZERO_STREAM_MIN (256 * 1024) //memset >= this uses non-temporal stores
+
 /* -------------------- Headers -------------------- */
 
-#ifdef USE_HEADER
-	#include "gpmalloc.h"
-#endif
+//Public API, the inline thread cache paths read block headers with the layout in it
+#include "gpmalloc.h"
 
 //Debug headers
 #ifdef DEBUG
@@ -37,113 +88,455 @@
 #include <stdbool.h>
 #include <memory.h>
 #include <stdint.h>
+#include <limits.h>
+
+//SSE2 streaming stores
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif //__SSE2__
 
 //Linux headers
 #ifdef __linux
-	#ifndef USE_SBRK
-		#include <sys/mman.h>
-	#endif
-
+	#include <sys/mman.h>
 	#include <unistd.h>
-
-	//pthread
-	#if defined(USE_LOCK) && !defined(USE_LOCK_SPIN)
-		#include<pthread.h>
-		#include <stdlib.h>
-	#endif //pthread
+	#include <time.h>
+	#include <fcntl.h>
+	#include <sys/stat.h>
+	#include <sys/syscall.h>
+	#include <errno.h>
+
+	#include <stdlib.h>
+
+	//Thread cache keys, pthread locks and the background free thread
+	#include <pthread.h>
+	#include <signal.h>
+
+	//Futex
+	#if defined(USE_LOCK) && !defined(USE_LOCK_SPIN) && !defined(USE_LOCK_PTHREAD)
+		#define USE_LOCK_FUTEX
+		#include <linux/futex.h>
+	#endif //Futex
 #endif //__linux
 
 //Windows 32 headers
 #ifdef _WIN32
 #endif //_WIN32
 
-//Malloc header
-#ifndef USE_HEADER
-#ifdef __cplusplus
-		extern "C" {
-			#endif
-
-			#ifndef USE_PREFIX
-				#define malloc mem_alloc
-				#define calloc mem_calloc
-				#define realloc mem_realloc
-				#define free mem_free
-			#endif /* end of not USE_PREFIX */
-
-			void * mem_alloc(size_t);
-			void * mem_calloc(size_t, size_t);
-			void * mem_realloc(void *, size_t);
-			void mem_free(void *);
-
-			#ifdef __cplusplus
-		};  /* end of extern "C" */
+//USDT probes
+#if defined(USE_PROBES) && defined(__has_include)
+	#if __has_include(<sys/sdt.h>)
+		#include <sys/sdt.h>
+		#define USE_PROBES_SDT
 	#endif
-#endif /* end of USE_HEADER */
+#endif //USE_PROBES
 
 /* ------------------- Typedef & Structures ------------------ */
 
-//define Lock
-#if defined(USE_LOCK) && defined(USE_LOCK_SPIN)
-	typedef volatile bool lock_t;
+//define Lock, counters are only written by the holder
+#if defined(USE_LOCK) && defined(USE_LOCK_PTHREAD)
+	typedef struct
+	{
+		pthread_mutex_t m;
+		size_t acquires;
+		size_t contended;
+		size_t sleeps;
+	} lock_t;
+
+	#define LOCK_INITIALIZER {PTHREAD_MUTEX_INITIALIZER, 0, 0, 0}
 #elif defined(USE_LOCK)
-	#ifdef __linux
-		typedef pthread_mutex_t lock_t;
-	#endif //__linux
+	//0 open, 1 locked, 2 locked and threads may be parked (futex only)
+	typedef struct
+	{
+		volatile int state;
+		int shared; //In memory mapped by several processes
+		size_t acquires;
+		size_t contended;
+		size_t sleeps;
+	} lock_t;
+
+	#define LOCK_INITIALIZER {0, 0, 0, 0, 0}
 
 	#ifdef _WIN32
 		//TODO: Add windows lock def
 	#endif //_WIN32
 #endif //USE_LOCK_SPIN
 
+//Spin hint
+#if defined(__x86_64__) || defined(__i386__)
+	#define LOCK_PAUSE() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+	#define LOCK_PAUSE() __asm__ __volatile__("yield")
+#else
+	#define LOCK_PAUSE()
+#endif
+
+//Link from a block, segment or pool to another, offset from the link itself so
+//arenas work wherever they are mapped. 0 is NULL
+typedef intptr_t link_t;
+
 //Memory block used or small free
 struct block
 {
 	size_t size;
-	struct block * block_prev;
-	struct block * block_next;
+	link_t block_prev;
+	link_t block_next;
 } __attribute__((packed));
 
 //Free Memory block
 struct block_free
 {
 	size_t size;
-	struct block * block_prev;
-	struct block * block_next;
-	struct block_free * pool_prev;
-	struct block_free * pool_next;
+	link_t block_prev;
+	link_t block_next;
+	link_t pool_prev;
+	link_t pool_next;
 } __attribute__((packed));
 
-//Holds free blocks as linked list
+//Start of a mapping or of a run of blocks on the sbrk heap, first block follows
+struct segment
+{
+	link_t prev;
+	link_t next;
+};
+
+//Holds free blocks as linked list, and freed blocks not yet joined (fast)
 struct pool
 {
-	struct block_free * start;
-	struct block_free * end;
+	link_t start;
+	link_t end;
 	size_t size;
-} __attribute__((packed));
+	link_t fast;
+	size_t fast_size;
+	lock_t lock;
+};
 
-/* ----------------- vars & macros ---------------- */
+#define CLASS_MAX (TABLE_SIZE / CLASS_STEP) //Index of pool for sizes > TABLE_SIZE
+
+//Where an arena gets its memory
+enum arena_kind
+{
+	ARENA_HEAP, //sbrk heap or mmap segments, as backend
+	ARENA_REGION, //Fixed range grown like sbrk, e.g. a mapped file
+	ARENA_SHARED, //Region mapped by several processes
+	ARENA_COMPRESSED //Private region named by 32-bit offsets
+};
+
+/*
+ * Arena, a heap with its own pools and block chain
+ *
+ * Each pool has a lock for its list. lock_heap guards the block chain
+ * (block_prev, block_next, block_last, segment_list), changing block sizes and
+ * growing or trimming the heap. Used state is set under the lock of the pool
+ * that held the block and cleared under lock_heap.
+ *
+ * Fast lists belong to the pool and use its lock. Blocks on them stay marked
+ * used so joins leave them alone.
+ *
+ * Order: lock_heap first, then at most one pool lock at a time. A thread
+ * holding a pool lock never waits for lock_heap, so allocations that fit a
+ * block exactly only take a pool lock, and joins can take free neighbours
+ * out of their pools.
+ *
+ * Region arenas keep this struct at the start of the region.
+ */
+struct mem_arena
+{
+	//Read before a region is mapped
+	struct
+	{
+		uint64_t magic; //ARENA_MAGIC once set up
+		unsigned int version;
+		unsigned int clean; //Closed, pools can be trusted
+		struct mem_arena * base; //Address the region was made at
+		size_t size; //Bytes in the region
+		size_t classes; //Signature of the size classes pools were filled with
+		void * root;
+	} header;
 
-//Hash table
-struct pool table[TABLE_SIZE];
+	enum arena_kind kind;
+	size_t fast_max;
 
-unsigned int pool_min_index = 0;
-unsigned int pool_max_index = 0;
+	//Pools and bit per pool that holds free blocks
+	struct pool table[CLASS_MAX + 1];
+	uint64_t table_map[(CLASS_MAX + 64) / 64];
 
-//Pointer to last block (for sbrk and tracking)
-struct block * block_last;
+	//Last block (for sbrk and tracking)
+	link_t block_last;
 
-//Lock
-#ifndef USE_LOCK_GLOBAL
-	lock_t l;
-#endif
+	//Every mapping and heap run, for walking the heap
+	link_t segment_list;
+
+	lock_t lock_heap;
+
+	//Time the top of the heap was found free (ms), 0 if not waiting to trim
+	size_t decay_start;
+
+	//Bytes in fast lists
+	size_t fast_bytes;
+
+	//Free bytes kept at the top of the heap, faulted in when it grows
+	size_t headroom;
+
+	//Region, offsets from the arena. Bytes at or above region_high were never handed out and are 0
+	size_t region_top;
+	size_t region_high;
+
+	//Heap arenas, where segments come from, smallest mapping and if mappings are faulted in at once
+	int backend;
+	size_t map_min;
+	bool populate;
+};
+
+//Arena mapped by this process. Maps are never freed, threads in arena_find may still read them
+struct arena_map
+{
+	struct mem_arena * arena;
+	void * end; //NULL once unmapped, the map is then reused
+	int fd;
+	struct arena_map * next;
+};
+
+//Mapping an object pool carves objects from, objects start at the first multiple of the pool alignment
+struct objpool_slab
+{
+	struct objpool_slab * next;
+};
+
+//Free objects of a pool held by one thread
+struct objpool_magazine
+{
+	struct mem_objpool * pool;
+	struct objpool_magazine * next; //In a depot list
+	struct objpool_magazine * all; //Every magazine of the pool
+	unsigned int count;
+	void * objects[];
+};
+
+/*
+ * Object pool, objects of one size cut from slabs. Free objects are linked through
+ * their first word.
+ *
+ * lock guards the fields below it. A magazine is only touched by the thread it is
+ * set for, or under lock while it is in a depot list.
+ */
+struct mem_objpool
+{
+	size_t size; //Stride, a multiple of align
+	size_t align;
+	size_t slab_size;
+	unsigned int magazine; //Objects per magazine, 0 if none
+	pthread_key_t key;
+
+	lock_t lock;
+	void * free;
+	char * top; //Next object never handed out in the newest slab
+	char * end;
+	struct objpool_slab * slabs;
+	struct objpool_magazine * depot_full; //Holding objects
+	struct objpool_magazine * depot_empty;
+	struct objpool_magazine * magazines;
+};
+
+/*
+ * Thread taking part in epoch reclamation. epoch is the global epoch the thread
+ * entered in shifted left by one, bit 0 is set while it is inside. Records are
+ * never freed, a record of an exited thread is taken by the next new thread.
+ *
+ * Limbo lists hold deferred frees by the epoch they were deferred in. Nodes are
+ * kept in bags, a reader may still load a node until it is freed.
+ */
+struct epoch_bag
+{
+	struct epoch_bag * next;
+	unsigned int count;
+	void * nodes[EPOCH_BATCH];
+};
+
+struct epoch_thread
+{
+	size_t epoch;
+	int taken;
+	struct epoch_thread * next; //Every record
+	unsigned int nest;
+	unsigned int count; //Deferred since the last try to advance
+	struct epoch_bag * limbo[3];
+	size_t limbo_epoch[3];
+};
+
+//Runtime configuration
+enum config_backend
+{
+	BACKEND_SBRK,
+	BACKEND_MMAP
+};
+
+enum config_hugepage
+{
+	HUGEPAGE_DEFAULT,
+	HUGEPAGE_ALWAYS,
+	HUGEPAGE_NEVER
+};
+
+struct config
+{
+	enum config_backend backend;
+	enum config_hugepage hugepage;
+	unsigned int arenas;
+	unsigned int cache;
+	size_t mmap_threshold;
+	size_t page_min;
+	size_t fast_max;
+	size_t fast_limit;
+	size_t headroom;
+	size_t prewarm;
+	size_t prewarm_blocks;
+	size_t async_min;
+	size_t async_limit;
+	long decay;
+	bool debug;
+	char profile[256];
+};
+
+/* ----------------- vars & macros ---------------- */
+
+//Configuration, set once by mem_init
+struct config config = {
+	#ifdef USE_SBRK
+		.backend = BACKEND_SBRK,
+	#else
+		.backend = BACKEND_MMAP,
+	#endif
+	.hugepage = HUGEPAGE_DEFAULT,
+	.arenas = ARENA_COUNT,
+	.cache = CACHE_SIZE,
+	.mmap_threshold = MMAP_THRESHOLD,
+	.page_min = PAGE_MIN_ALLOC,
+	.fast_max = FAST_MAX,
+	.fast_limit = FAST_LIMIT,
+	.headroom = HEADROOM,
+	.prewarm = PREWARM,
+	.prewarm_blocks = PREWARM_BLOCKS,
+	.async_min = ASYNC_MIN,
+	.async_limit = ASYNC_LIMIT,
+	.decay = DECAY_TIME,
+	.debug = false,
+	.profile = ""
+};
+
+bool config_complete = false;
+
+//Set up state, threads that find INIT_RUNNING wait for INIT_DONE
+#define INIT_NONE 0
+#define INIT_RUNNING 1
+#define INIT_DONE 2
+int init_state = INIT_NONE;
+
+#define ARENA_MAGIC 0x3150414548504d47ULL //"GMPHEAP1"
+#define ARENA_VERSION 2 //2: used blocks are tagged SIZE_IS_REGION
+
+//Arena for mem_alloc, mapped first, then arenas over a region (searched by address on free)
+struct mem_arena arena_main;
+
+//Arenas for mem_alloc_flags hints, tagged in used block sizes (SIZE_ARENA) so frees find them
+#define ARENA_HINTS 3
+struct mem_arena arena_hint[ARENA_HINTS];
+struct arena_map arena_maps = {&arena_main, NULL, -1, NULL};
+lock_t lock_arenas = LOCK_INITIALIZER;
+
+//Size classes, step (size / CLASS_STEP rounded up) to pool index and pool index to class size
+unsigned short table_class[CLASS_MAX + 1];
+unsigned int table_class_size[CLASS_MAX + 1];
+unsigned int table_class_count = 0;
+
+//Requested sizes per step, last entry counts sizes > TABLE_SIZE
+size_t table_histogram[CLASS_MAX + 2];
+
+//Thread cache, limit is 0 until the allocator is set up so inline frees (see gpmalloc.h) go through mem_free
+__thread struct mem_tcache mem_tcache;
+unsigned int mem_tcache_limit = 0;
+pthread_key_t tcache_key;
+
+//Epoch reclamation, limbo lists of exited threads are kept until another thread reclaims them
+size_t epoch_global = 0;
+struct epoch_thread * epoch_threads = NULL;
+__thread struct epoch_thread * epoch_self = NULL;
+pthread_key_t epoch_key;
+lock_t lock_epoch = LOCK_INITIALIZER;
+struct epoch_bag * epoch_orphan[3];
+size_t epoch_orphan_epoch[3];
+
+//Background frees, blocks are pushed lock-free and linked through their first payload word,
+//the second holds their arena. The mutex is only taken to wake the thread or wait for it, and
+//around fork so the thread is never inside an arena when the heap is copied
+void * async_queue = NULL;
+bool async_started = false;
+bool async_sleeping = false;
+bool async_busy = false; //Freeing a batch
+bool async_forking = false; //Thread must not take a batch
+size_t async_bytes = 0; //Queued and not yet freed
+size_t async_queued = 0;
+size_t async_done = 0;
+pthread_mutex_t async_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t async_wake = PTHREAD_COND_INITIALIZER;
+pthread_cond_t async_flushed = PTHREAD_COND_INITIALIZER;
 
 #define PAGE_FAIL NULL
 
-//Size
-#define SIZE_GET(s) (s & (SIZE_MAX / 2))
-#define SIZE_SET(s, x) (s = ((size_t)x | (s & ~(sizeof(size_t) / 2))))
+/*
+ * Static probes, a nop in the code until a tracer attaches. Arguments:
+ *
+ * alloc_entry      size
+ * alloc_exit       size, address, bin (thread cache bin up to MEM_TCACHE_MAX, else pool index)
+ * free_entry       address
+ * free_exit        address, size, bin
+ * heap_grow        address, bytes (sbrk, region or new mapping)
+ * heap_trim        address, bytes given back
+ * block_split      address, size, bytes split off
+ * block_join       address, size after join
+ * lock_contended   lock, times parked
+ */
+#ifdef USE_PROBES_SDT
+	#define PROBE1(name, a) DTRACE_PROBE1(gpmalloc, name, a)
+	#define PROBE2(name, a, b) DTRACE_PROBE2(gpmalloc, name, a, b)
+	#define PROBE3(name, a, b, c) DTRACE_PROBE3(gpmalloc, name, a, b, c)
+#else
+	#define PROBE1(name, a)
+	#define PROBE2(name, a, b)
+	#define PROBE3(name, a, b, c)
+#endif
+
+//Link target, and link set to target
+#define LINK_GET(l) (((l) == 0)? NULL : (void *)((char *)&(l) + (l)))
+#define LINK_SET(l, p) ((l) = ((p) == NULL)? 0 : (link_t)((char *)(p) - (char *)&(l)))
+
+//Size, top bits are used state, zeroed payload, first block of a mapping, hint arena of a used block
+//and used block of a region arena
+#define SIZE_MASK (SIZE_MAX >> 6)
+#define SIZE_GET(s) (s & SIZE_MASK)
+#define SIZE_SET(s, x) (s = ((size_t)(x) | (s & ~SIZE_MASK)))
 #define SIZE_IS_USED(s) ((int)((s >> ((sizeof(size_t) * 8) - 1)) & 1))
 #define SIZE_STATE_SET(s, x) (s ^= (-(size_t)x ^ s) & ((size_t)1 << ((sizeof(size_t) * 8) - 1)))
+#define SIZE_IS_ZERO(s) ((int)((s >> ((sizeof(size_t) * 8) - 2)) & 1))
+#define SIZE_ZERO_SET(s, x) (s ^= (-(size_t)(x) ^ s) & ((size_t)1 << ((sizeof(size_t) * 8) - 2)))
+#define SIZE_IS_MAPPED(s) ((int)((s >> ((sizeof(size_t) * 8) - 3)) & 1))
+#define SIZE_MAPPED_SET(s, x) (s ^= (-(size_t)(x) ^ s) & ((size_t)1 << ((sizeof(size_t) * 8) - 3)))
+#define SIZE_ARENA(s) ((unsigned int)((s >> ((sizeof(size_t) * 8) - 5)) & 3))
+#define SIZE_ARENA_SET(s, x) (s = (s & ~((size_t)3 << ((sizeof(size_t) * 8) - 5))) | ((size_t)(x) << ((sizeof(size_t) * 8) - 5)))
+#define SIZE_IS_REGION(s) ((int)((s >> ((sizeof(size_t) * 8) - 6)) & 1))
+#define SIZE_REGION_SET(s, x) (s ^= (-(size_t)(x) ^ s) & ((size_t)1 << ((sizeof(size_t) * 8) - 6)))
+
+//Inline paths in gpmalloc.h read headers with their own copy of the layout
+_Static_assert(MEM_BLOCK_HEADER == sizeof(struct block), "MEM_BLOCK_HEADER does not match struct block");
+_Static_assert(MEM_BLOCK_SIZE_MASK == SIZE_MASK, "MEM_BLOCK_SIZE_MASK does not match SIZE_MASK");
+_Static_assert(SIZE_IS_USED(MEM_BLOCK_USED) == 1 && SIZE_IS_USED(~MEM_BLOCK_USED) == 0, "MEM_BLOCK_USED does not match SIZE_IS_USED");
+_Static_assert(SIZE_IS_ZERO(MEM_BLOCK_ZERO) == 1 && SIZE_IS_ZERO(~MEM_BLOCK_ZERO) == 0, "MEM_BLOCK_ZERO does not match SIZE_IS_ZERO");
+_Static_assert(SIZE_IS_MAPPED(MEM_BLOCK_MAPPED) == 1 && SIZE_IS_MAPPED(~MEM_BLOCK_MAPPED) == 0, "MEM_BLOCK_MAPPED does not match SIZE_IS_MAPPED");
+_Static_assert(SIZE_ARENA(MEM_BLOCK_ARENA) == 3 && SIZE_ARENA(~MEM_BLOCK_ARENA) == 0, "MEM_BLOCK_ARENA does not match SIZE_ARENA");
+_Static_assert(SIZE_IS_REGION(MEM_BLOCK_REGION) == 1 && SIZE_IS_REGION(~MEM_BLOCK_REGION) == 0, "MEM_BLOCK_REGION does not match SIZE_IS_REGION");
+
+//Smallest payload, a free block keeps its pool pointers in the payload
+#define BLOCK_SIZE_MIN (sizeof(struct block_free) - sizeof(struct block))
+#define SIZE_ALIGN(s) (((s) + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1))
 
 /* ------------------------------------------------- */
 
@@ -155,14 +548,19 @@ struct block * block_last;
  */
 void lock_create(lock_t * l)
 {
-	#ifdef USE_LOCK_SPIN
-		l = 0;
-	#endif //USE_LOCK_SPIN
+	l->acquires = 0;
+	l->contended = 0;
+	l->sleeps = 0;
+
+	#if defined(USE_LOCK_SPIN) || defined(USE_LOCK_FUTEX)
+		l->state = 0;
+		l->shared = 0;
+	#endif
 
-	//Linux
-	#if defined(__linux) && !defined(USE_LOCK_SPIN)
-		pthread_mutex_init(l, NULL);
-	#endif //__linux
+	//pthread
+	#ifdef USE_LOCK_PTHREAD
+		pthread_mutex_init(&l->m, NULL);
+	#endif //USE_LOCK_PTHREAD
 
 	//Windows
 	#if defined(_WIN32) && !defined(USE_LOCK_SPIN)
@@ -172,6 +570,34 @@ void lock_create(lock_t * l)
 	//Add you custom lock here
 }
 
+/*
+ * @function lock_create_shared
+ * Creates lock in memory mapped by several processes
+ *
+ * @param lock_t * l
+ */
+void lock_create_shared(lock_t * l)
+{
+	lock_create(l);
+
+	//Futex waits are keyed by the page, not the address in this process
+	#if defined(USE_LOCK_SPIN) || defined(USE_LOCK_FUTEX)
+		l->shared = 1;
+	#endif
+
+	//pthread
+	#ifdef USE_LOCK_PTHREAD
+		pthread_mutexattr_t attr;
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutex_destroy(&l->m);
+		pthread_mutex_init(&l->m, &attr);
+		pthread_mutexattr_destroy(&attr);
+	#endif //USE_LOCK_PTHREAD
+
+	//Add you custom lock here
+}
+
 /*
  * @function lock_remove
  * Removes lock
@@ -180,10 +606,12 @@ void lock_create(lock_t * l)
  */
 void lock_remove(lock_t * l)
 {
-	//Linux
-	#if defined(__linux) && !defined(USE_LOCK_SPIN)
-		pthread_mutex_destroy(l);
-	#endif //__linux
+	//pthread
+	#ifdef USE_LOCK_PTHREAD
+		pthread_mutex_destroy(&l->m);
+	#else
+		(void)l; //Futex and spin locks hold nothing to free
+	#endif //USE_LOCK_PTHREAD
 
 	//Windows
 	#if defined(_WIN32) && !defined(USE_LOCK_SPIN)
@@ -193,9 +621,25 @@ void lock_remove(lock_t * l)
 	//Add you custom lock here
 }
 
+/*
+ * @function lock_backoff
+ * Spins for delay pause instructions and returns the next delay.
+ *
+ * @param unsigned int delay
+ * @return unsigned int delay
+ */
+static inline unsigned int lock_backoff(unsigned int delay)
+{
+	for (unsigned int i = 0; i < delay; ++i)
+		LOCK_PAUSE();
+
+	return (delay < LOCK_BACKOFF_MAX)? delay * 2 : delay;
+}
+
 /*
  * @function lock_wait
- * Waits for lock to be open then locks it.
+ * Waits for lock to be open then locks it. The futex lock spins with
+ * exponential backoff for LOCK_SPIN tries, then parks the thread.
  *
  * @param lock_t * l
  */
@@ -203,14 +647,58 @@ void lock_wait(lock_t * l)
 {
 	//Spinlock
 	#ifdef USE_LOCK_SPIN
-		while(!__sync_lock_test_and_set (l, false, true));
-		__sync_synchronize();
+		if (__sync_lock_test_and_set(&l->state, 1) != 0)
+		{
+			unsigned int delay = 1;
+			do
+				delay = lock_backoff(delay);
+			while (l->state != 0 || __sync_lock_test_and_set(&l->state, 1) != 0);
+
+			l->contended++;
+			PROBE2(lock_contended, l, 0);
+		}
 	#endif //USE_LOCK_SPIN
 
-	//Linux
-	#if defined(__linux) && !defined(USE_LOCK_SPIN)
-		pthread_mutex_lock(l);
-	#endif //__linux
+	//Futex
+	#ifdef USE_LOCK_FUTEX
+		int c = 0;
+		if (!__atomic_compare_exchange_n(&l->state, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		{
+			//Holder is likely running, try again for a short while
+			bool locked = false;
+			unsigned int delay = 1;
+			for (unsigned int i = 0; i < LOCK_SPIN && !locked; ++i)
+			{
+				delay = lock_backoff(delay);
+				c = 0;
+				locked = __atomic_load_n(&l->state, __ATOMIC_RELAXED) == 0 &&
+				         __atomic_compare_exchange_n(&l->state, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+			}
+
+			//Mark waiters and park until the lock is open
+			size_t sleeps = 0;
+			if (!locked)
+				while (__atomic_exchange_n(&l->state, 2, __ATOMIC_ACQUIRE) != 0)
+				{
+					syscall(SYS_futex, &l->state, (l->shared)? FUTEX_WAIT : FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+					sleeps++;
+				}
+
+			l->contended++;
+			l->sleeps += sleeps;
+			PROBE2(lock_contended, l, sleeps);
+		}
+	#endif //USE_LOCK_FUTEX
+
+	//pthread
+	#ifdef USE_LOCK_PTHREAD
+		if (pthread_mutex_trylock(&l->m) != 0)
+		{
+			pthread_mutex_lock(&l->m);
+			l->contended++;
+			PROBE2(lock_contended, l, 0);
+		}
+	#endif //USE_LOCK_PTHREAD
 
 	//Windows
 	#if defined(_WIN32) && !defined(USE_LOCK_SPIN)
@@ -218,11 +706,13 @@ void lock_wait(lock_t * l)
 	#endif
 
 	//Add you custom lock here
+
+	l->acquires++;
 }
 
 /*
  * @function lock_signal
- * Unlocks lock and signals all waiting threads
+ * Unlocks lock and wakes a parked thread
  *
  * @param lock_t * l
  */
@@ -230,14 +720,19 @@ void lock_signal(lock_t * l)
 {
 	//Spinlock
 	#ifdef USE_LOCK_SPIN
-		__sync_synchronize();
-		*l = 0;
+		__sync_lock_release(&l->state);
 	#endif //USE_LOCK_SPIN
 
-	//Linux
-	#if defined(__linux) && !defined(USE_LOCK_SPIN)
-		pthread_mutex_unlock(l);
-	#endif //__linux
+	//Futex
+	#ifdef USE_LOCK_FUTEX
+		if (__atomic_exchange_n(&l->state, 0, __ATOMIC_RELEASE) == 2)
+			syscall(SYS_futex, &l->state, (l->shared)? FUTEX_WAKE : FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	#endif //USE_LOCK_FUTEX
+
+	//pthread
+	#ifdef USE_LOCK_PTHREAD
+		pthread_mutex_unlock(&l->m);
+	#endif //USE_LOCK_PTHREAD
 
 	//Windows
 	#if defined(_WIN32) && !defined(USE_LOCK_SPIN)
@@ -257,12 +752,93 @@ void lock_signal(lock_t * l)
 unsigned int table_index_get(size_t size)
 {
 	if (size > TABLE_SIZE)
-		return (unsigned int)TABLE_SIZE;
+		return (unsigned int)CLASS_MAX;
 
-	if (size == 0)
-		return 0;
+	return table_class[(size + CLASS_STEP - 1) / CLASS_STEP];
+}
+
+/*
+ * @function table_size_get
+ * Rounds allocation size up to its size class.
+ *
+ * @param size_t size
+ * @return size_t class size
+ */
+size_t table_size_get(size_t size)
+{
+	if (size < BLOCK_SIZE_MIN)
+		size = BLOCK_SIZE_MIN;
+
+	if (size > TABLE_SIZE)
+		return SIZE_ALIGN(size);
+
+	return table_class_size[table_class[(size + CLASS_STEP - 1) / CLASS_STEP]];
+}
+
+/*
+ * @function table_class_set
+ * Sets the size classes. Pools must be empty.
+ *
+ * @param const unsigned int * bounds (ascending, last is TABLE_SIZE), unsigned int count
+ */
+void table_class_set(const unsigned int * bounds, unsigned int count)
+{
+	unsigned int c = 0;
+	for (unsigned int i = 0; i <= CLASS_MAX; ++i)
+	{
+		if (i * CLASS_STEP > bounds[c])
+			c++;
+
+		table_class[i] = (unsigned short)c;
+	}
+
+	for (c = 0; c < count; ++c)
+		table_class_size[c] = bounds[c];
+
+	table_class_size[CLASS_MAX] = 0;
+	table_class_count = count;
+}
+
+/*
+ * @function table_class_reset
+ * Sets one size class per CLASS_STEP.
+ */
+void table_class_reset(void)
+{
+	unsigned int bounds[CLASS_MAX];
+	for (unsigned int i = 0; i < CLASS_MAX; ++i)
+		bounds[i] = (i + 1) * CLASS_STEP;
+
+	table_class_set(bounds, CLASS_MAX);
+}
+
+/*
+ * @function table_class_signature
+ * Hash of the size classes, changes when pools would be binned differently.
+ *
+ * @return size_t
+ */
+size_t table_class_signature(void)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for (unsigned int i = 0; i < table_class_count; ++i)
+		h = (h ^ table_class_size[i]) * 1099511628211ULL;
+
+	return (size_t)h;
+}
 
-	return (unsigned int)size - 1;
+/*
+ * @function table_histogram_record
+ * Counts allocation size for deriving size classes.
+ *
+ * @param size_t size
+ */
+static inline void table_histogram_record(size_t size)
+{
+	#ifdef USE_HISTOGRAM
+		//Not atomic, counts are a sample under contention
+		table_histogram[(size > TABLE_SIZE)? CLASS_MAX + 1 : (size + CLASS_STEP - 1) / CLASS_STEP]++;
+	#endif //USE_HISTOGRAM
 }
 
 /*
@@ -283,41 +859,84 @@ size_t page_size_get(void)
 	return (size_t)PAGESIZE_DEFAULT;
 }
 
+/*
+ * @function page_advise
+ * Applies the huge page mode to the whole pages in a range.
+ *
+ * @param void * addr, size_t size
+ */
+void page_advise(void * addr, size_t size)
+{
+	#if defined(__linux) && defined(MADV_HUGEPAGE)
+		if (config.hugepage == HUGEPAGE_DEFAULT)
+			return;
+
+		size_t page = page_size_get();
+		size_t start = ((size_t)addr + page - 1) & ~(page - 1);
+		size_t end = ((size_t)addr + size) & ~(page - 1);
+		if (end <= start)
+			return;
+
+		madvise((void *)start, end - start, (config.hugepage == HUGEPAGE_ALWAYS)? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+	#endif
+}
+
+/*
+ * @function page_populate
+ * Faults in the whole pages of a range ahead of use, and locks them in memory
+ * if asked. Contents are kept.
+ *
+ * @param void * addr, size_t size, bool lock
+ * @return int 0 success, -1 fail
+ */
+int page_populate(void * addr, size_t size, bool lock)
+{
+	#ifdef __linux
+		size_t page = page_size_get();
+		size_t start = ((size_t)addr + page - 1) & ~(page - 1);
+		size_t end = ((size_t)addr + size) & ~(page - 1);
+		if (end <= start)
+			return 0;
+
+		int result = -1;
+		#ifdef MADV_POPULATE_WRITE
+			result = madvise((void *)start, end - start, MADV_POPULATE_WRITE);
+		#endif
+
+		//Older kernels, write fault every page without changing it
+		if (result != 0)
+			for (size_t p = start; p < end; p += page)
+				__atomic_fetch_or((char *)p, 0, __ATOMIC_RELAXED);
+
+		if (lock && mlock((void *)start, end - start) != 0)
+			return -1;
+
+		return 0;
+	#elif _WIN32
+		//TODO: add windows support for populate
+	#endif
+
+	return -1;
+}
+
 /*
  * @function page_get
- * Gets a number of contiguous pages from the os. All bytes are set to 0;
+ * Grows the heap by size bytes. Only the new pages are set to 0.
  *
  * @param size_t size
  * @return void * addr to pages, PAGE_FAIL if fail
  */
 void * page_get(size_t size)
 {
-	#ifdef USE_SBRK
+	#ifdef __linux
 		void * addr = sbrk((intptr_t)size);
 		if (addr == (void *)-1)
-			return NULL;
+			return PAGE_FAIL;
 
+		page_advise(addr, size);
 		return addr;
-	#else
-		if (size < page_size_get())
-			size = page_size_get();
-
-		#ifdef __linux
-			//To add performance on embedded devices use MAP_UNINITIALIZED flag and set bytes to
-
-			#ifdef MAP_ANONYMOUS
-				void * addr =  mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-			#else //For systems with no MAP_ANONYMOUS eg BSD
-				int fd = open("/dev/zero", O_RDWR);
-				void * addr =  mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, -1, 0);
-			#endif
-			if(addr == MAP_FAILED)
-				return PAGE_FAIL;
-			else
-				return addr;
-		#elif _WIN32
-			//TODO: add windows memory support
-		#endif
+	#elif _WIN32
+		//TODO: add windows memory support
 	#endif
 
 	return PAGE_FAIL; //Cannot find a function
@@ -325,471 +944,3953 @@ void * page_get(size_t size)
 
 /*
  * @function page_free
- * Return pages to system
+ * Shrinks the heap, addr + size must be the end of the heap.
  *
  * @param void * address, size_t size
- * @return int 0 success and -1 on fail
+ * @return int 0 success and 1 on fail
  */
 int page_free(void * addr, size_t size)
 {
-	#ifdef USE_SBRK
-		if (sbrk(-(intptr_t)(sbrk(0) - size)) == (void *)-1)
+	#ifdef __linux
+		//Only shrink if nothing was placed above the block
+		if (sbrk(0) != addr + size)
+			return 1;
+
+		if (sbrk(-(intptr_t)size) == (void *)-1)
 			return 1;
 		return 0;
-	#else
-		#ifdef __linux
-			return munmap(addr, size);
-		#elif _WIN32
-			//TODO: add windows support for free page
-		#endif
+	#elif _WIN32
+		//TODO: add windows support for free page
 	#endif
+
+	return 1;
 }
 
 /*
- * @function pool_swap
- * Swaps two free nodes in pool
+ * @function page_map
+ * Gets a number of contiguous pages from the os. All bytes are set to 0;
  *
- * @param struct block_free * a, struct block_free * b
+ * @param size_t size
+ * @return void * addr to pages, PAGE_FAIL if fail
  */
-void pool_swap(struct block_free * a, struct block_free * b)
+void * page_map(size_t size)
 {
-	if (a == NULL || b == NULL)
-		return;
-
-	//Switch prev pointers
-	if (a->pool_prev != NULL)
-		a->pool_prev->pool_next = b;
+	if (size < page_size_get())
+		size = page_size_get();
 
-	struct block_free * temp = a->pool_prev;
-	a->pool_prev = b;
-	b->pool_prev = temp;
+	#ifdef __linux
+		//To add performance on embedded devices use MAP_UNINITIALIZED flag and set bytes to
+
+		#ifdef MAP_ANONYMOUS
+			void * addr =  mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		#else //For systems with no MAP_ANONYMOUS eg BSD
+			int fd = open("/dev/zero", O_RDWR);
+			void * addr =  mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+			close(fd);
+		#endif
+		if(addr == MAP_FAILED)
+			return PAGE_FAIL;
 
-	//Switch next pointers
-	if (b->pool_next != NULL)
-		b->pool_next->pool_prev = a;
+		page_advise(addr, size);
+		return addr;
+	#elif _WIN32
+		//TODO: add windows memory support
+	#endif
 
-	temp = b->pool_next;
-	b->pool_next = a;
-	a->pool_next = temp;
+	return PAGE_FAIL; //Cannot find a function
 }
 
 /*
- * @function pool_sort
- * Sorts node in pool
+ * @function page_reserve
+ * Reserves size bytes of address space, pages are only backed once touched.
  *
- * @param struct block_free * b
+ * @param size_t size
+ * @return void * address, PAGE_FAIL if fail
  */
-void pool_sort(struct block_free * b)
+void * page_reserve(size_t size)
 {
-	struct pool * p = &table[table_index_get(SIZE_GET(b->size))];
-
-	while (b->pool_next != NULL)
-	{
-		if (SIZE_GET(b->size) <= SIZE_GET(b->pool_next->size))
-			break;
-
-		if (b == p->start)
-			p->start = b->pool_next;
-
-		if (b->pool_next == p->end)
-			p->end = b;
+	#if defined(__linux) && defined(MAP_ANONYMOUS) && defined(MAP_NORESERVE)
+		void * addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (addr == MAP_FAILED)
+			return PAGE_FAIL;
 
-		pool_swap(b, b->pool_next);
-	}
+		page_advise(addr, size);
+		return addr;
+	#else
+		return page_map(size);
+	#endif
 }
 
 /*
- * @function pool_insert
- * Adds free block into pool's linked list
+ * @function page_unmap
+ * Return pages from page_map to system
  *
- * @param struct block_free * b
- * @return int 0 success
+ * @param void * address, size_t size
+ * @return int 0 success and -1 on fail
  */
-int pool_insert(struct block_free * b)
+int page_unmap(void * addr, size_t size)
 {
-	if (b == NULL)
-		return -1;
-
-	struct pool * p = &table[table_index_get(SIZE_GET(b->size))];
+	#ifdef __linux
+		return munmap(addr, size);
+	#elif _WIN32
+		//TODO: add windows support for free page
+	#endif
 
-	//Lock pool
-	lock_wait(&l);
+	return -1;
+}
 
-	//First node
-	if (p->start == NULL)
-	{
-		b->pool_prev = NULL;
-		b->pool_next = NULL;
-		p->start = b;
-		p->end = b;
-		p->size++;
-		return 0;
-	}
+/*
+ * @function page_map_file
+ * Maps size bytes of file shared at address, or anywhere if address is NULL.
+ * Fails rather than map elsewhere.
+ *
+ * @param int fd, void * address, size_t size
+ * @return void * address, PAGE_FAIL if fail
+ */
+void * page_map_file(int fd, void * address, size_t size)
+{
+	#ifdef __linux
+		int flags = MAP_SHARED;
+		#ifdef MAP_FIXED_NOREPLACE
+			if (address != NULL)
+				flags |= MAP_FIXED_NOREPLACE;
+		#endif //Else address is only a hint
 
-	b->pool_prev = NULL;
-	b->pool_next = p->start;
-	p->start->pool_prev = b;
-	p->start = b;
-	p->size++;
-	pool_sort(b); //Sort
+		void * addr = mmap(address, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+		if (addr == MAP_FAILED)
+			return PAGE_FAIL;
 
-	if (p->size <= table[pool_min_index].size)
-		pool_min_index = table_index_get(SIZE_GET(b->size));
+		if (address != NULL && addr != address)
+		{
+			munmap(addr, size);
+			return PAGE_FAIL;
+		}
 
-	if (p->size >= table[pool_max_index].size)
-		pool_max_index = table_index_get(SIZE_GET(b->size));
+		return addr;
+	#elif _WIN32
+		//TODO: add windows file mapping
+	#endif
 
-	lock_signal(&l); //Unlock
-	return 0;
+	return PAGE_FAIL;
 }
 
 /*
- * @function pool_remove
- * Removes node from pool
+ * @function arena_setup
+ * Empties pools and creates the locks of arena.
  *
- * @param struct block_free * b
- * return int 0 success
+ * @param struct mem_arena * a
  */
-int pool_remove(struct block_free * b)
+void arena_setup(struct mem_arena * a)
 {
+	void (*create)(lock_t *) = (a->kind == ARENA_SHARED)? lock_create_shared : lock_create;
+
+	memset(a->table, 0, sizeof(a->table));
+	memset(a->table_map, 0, sizeof(a->table_map));
+	for (unsigned int i = 0; i <= CLASS_MAX; ++i)
+		create(&a->table[i].lock);
+
+	create(&a->lock_heap);
+	a->decay_start = 0;
+	a->fast_bytes = 0;
+	a->header.classes = table_class_signature();
+}
+
+/*
+ * @function arena_locks_create
+ * Creates the locks of arena again, for regions mapped by a new process.
+ *
+ * @param struct mem_arena * a
+ */
+void arena_locks_create(struct mem_arena * a)
+{
+	for (unsigned int i = 0; i <= CLASS_MAX; ++i)
+		lock_create(&a->table[i].lock);
+
+	lock_create(&a->lock_heap);
+}
+
+/*
+ * @function arena_region_setup
+ * Sets up a new arena at the start of a mapped region. The magic is set last.
+ *
+ * @param struct mem_arena * a, enum arena_kind kind, size_t size (bytes mapped)
+ */
+void arena_region_setup(struct mem_arena * a, enum arena_kind kind, size_t size)
+{
+	a->kind = kind;
+	a->fast_max = 0; //Deferred frees look used after a crash and to other processes
+	a->headroom = 0;
+	arena_setup(a);
+	a->block_last = 0;
+	a->segment_list = 0;
+	a->region_top = (sizeof(struct mem_arena) + 15) & ~(size_t)15;
+	a->region_high = a->region_top;
+
+	a->header.version = ARENA_VERSION;
+	a->header.base = a;
+	a->header.size = size;
+	a->header.root = NULL;
+	__atomic_store_n(&a->header.magic, ARENA_MAGIC, __ATOMIC_RELEASE);
+}
+
+/*
+ * @function arena_map_next
+ * Walks arenas mapped by this process, main first then regions.
+ *
+ * @param struct arena_map * m
+ * @return struct arena_map * next mapped arena, NULL after the last
+ */
+struct arena_map * arena_map_next(struct arena_map * m)
+{
+	do
+		m = __atomic_load_n(&m->next, __ATOMIC_ACQUIRE);
+	while (m != NULL && __atomic_load_n(&m->end, __ATOMIC_ACQUIRE) == NULL);
+
+	return m;
+}
+
+/*
+ * @function arena_map_add
+ * Adds a region arena to the arenas mapped by this process.
+ *
+ * @param struct mem_arena * a, size_t size (bytes mapped), int fd
+ * @return int 0 success, -1 fail
+ */
+int arena_map_add(struct mem_arena * a, size_t size, int fd)
+{
+	//Taken first, lock_arenas is held while the main arena is locked
+	struct arena_map * fresh = (struct arena_map *)mem_alloc(sizeof(struct arena_map));
+
+	lock_wait(&lock_arenas);
+	struct arena_map * m = arena_maps.next;
+	while (m != NULL && m->end != NULL)
+		m = m->next;
+
+	if (m == NULL && fresh != NULL)
+	{
+		m = fresh;
+		fresh = NULL;
+		m->end = NULL;
+		m->next = arena_maps.next;
+		__atomic_store_n(&arena_maps.next, m, __ATOMIC_RELEASE);
+	}
+
+	if (m != NULL)
+	{
+		m->arena = a;
+		m->fd = fd;
+		__atomic_store_n(&m->end, (void *)a + size, __ATOMIC_RELEASE);
+	}
+	lock_signal(&lock_arenas);
+
+	mem_free(fresh);
+	return (m == NULL)? -1 : 0;
+}
+
+/*
+ * @function arena_map_remove
+ * Removes a region arena from the arenas mapped by this process.
+ *
+ * @param struct mem_arena * a
+ * @return int fd of the region, -1 if not mapped
+ */
+int arena_map_remove(struct mem_arena * a)
+{
+	lock_wait(&lock_arenas);
+	struct arena_map * m = arena_map_next(&arena_maps);
+	while (m != NULL && m->arena != a)
+		m = arena_map_next(m);
+
+	int fd = -1;
+	if (m != NULL)
+	{
+		fd = m->fd;
+		__atomic_store_n(&m->end, NULL, __ATOMIC_RELEASE);
+	}
+	lock_signal(&lock_arenas);
+
+	return fd;
+}
+
+/*
+ * @function arena_find
+ * Finds the arena holding address. Anything outside a region is in the main arena.
+ *
+ * @param void * address
+ * @return struct mem_arena *
+ */
+struct mem_arena * arena_find(void * address)
+{
+	for (struct arena_map * m = arena_map_next(&arena_maps); m != NULL; m = arena_map_next(m))
+		if (address >= (void *)m->arena && address < m->end)
+			return m->arena;
+
+	return &arena_main;
+}
+
+/*
+ * @function arena_grow
+ * Grows arena by size bytes from sbrk or its region. All bytes are set to 0.
+ *
+ * @param struct mem_arena * a, size_t size
+ * @return void * addr, PAGE_FAIL if fail
+ */
+void * arena_grow(struct mem_arena * a, size_t size)
+{
+	if (a->kind != ARENA_HEAP)
+	{
+		size_t top = a->region_top;
+		if (a->header.size - top < size)
+			return PAGE_FAIL;
+
+		a->region_top += size;
+
+		//Below region_high the bytes were handed out before
+		if (top < a->region_high)
+			memset((void *)a + top, 0, ((a->region_top < a->region_high)? a->region_top : a->region_high) - top);
+		if (a->region_top > a->region_high)
+			a->region_high = a->region_top;
+
+		return (void *)a + top;
+	}
+
+	void * addr = page_get(size);
+	if (addr == PAGE_FAIL)
+		return PAGE_FAIL;
+
+	//Pages above the old break are new, only the rest of its page can hold old data
+	size_t head = (page_size_get() - ((size_t)addr & (page_size_get() - 1))) & (page_size_get() - 1);
+	memset(addr, 0, (head < size)? head : size);
+	return addr;
+}
+
+/*
+ * @function arena_shrink
+ * Gives back the top size bytes of arena, addr + size must be its end. Whole
+ * pages of a region are released so its file does not keep them.
+ *
+ * @param struct mem_arena * a, void * addr, size_t size
+ * @return int 0 success and 1 on fail
+ */
+int arena_shrink(struct mem_arena * a, void * addr, size_t size)
+{
+	if (a->kind == ARENA_HEAP)
+		return page_free(addr, size);
+
+	size_t top = (size_t)(addr - (void *)a);
+	if (top + size != a->region_top)
+		return 1;
+
+	a->region_top = top;
+
+	//Regions are page aligned, private ones drop their pages rather than punch the file
+	#if defined(__linux) && defined(MADV_REMOVE)
+		size_t page = page_size_get();
+		size_t start = (top + page - 1) & ~(page - 1);
+		if (start < a->region_high && madvise((void *)a + start, a->region_high - start, (a->kind == ARENA_COMPRESSED)? MADV_DONTNEED : MADV_REMOVE) == 0)
+			a->region_high = start;
+	#endif
+
+	return 0;
+}
+
+/*
+ * @function pool_swap
+ * Swaps two free nodes in pool, b follows a
+ *
+ * @param struct block_free * a, struct block_free * b
+ */
+void pool_swap(struct block_free * a, struct block_free * b)
+{
+	if (a == NULL || b == NULL)
+		return;
+
+	struct block_free * prev = LINK_GET(a->pool_prev);
+	struct block_free * next = LINK_GET(b->pool_next);
+
+	//Switch prev pointers
+	if (prev != NULL)
+		LINK_SET(prev->pool_next, b);
+
+	LINK_SET(a->pool_prev, b);
+	LINK_SET(b->pool_prev, prev);
+
+	//Switch next pointers
+	if (next != NULL)
+		LINK_SET(next->pool_prev, a);
+
+	LINK_SET(b->pool_next, a);
+	LINK_SET(a->pool_next, next);
+}
+
+/*
+ * @function pool_sort
+ * Sorts node in pool
+ *
+ * @param struct mem_arena * a, struct block_free * b
+ */
+void pool_sort(struct mem_arena * a, struct block_free * b)
+{
+	struct pool * p = &a->table[table_index_get(SIZE_GET(b->size))];
+
+	struct block_free * n;
+	while ((n = LINK_GET(b->pool_next)) != NULL)
+	{
+		if (SIZE_GET(b->size) <= SIZE_GET(n->size))
+			break;
+
+		if (b == LINK_GET(p->start))
+			LINK_SET(p->start, n);
+
+		if (n == LINK_GET(p->end))
+			LINK_SET(p->end, b);
+
+		pool_swap(b, n);
+	}
+}
+
+/*
+ * @function pool_insert
+ * Adds free block into pool's linked list
+ *
+ * @param struct mem_arena * a, struct block_free * b
+ * @return int 0 success
+ */
+int pool_insert(struct mem_arena * a, struct block_free * b)
+{
+	if (b == NULL)
+		return -1;
+
+	unsigned int index = table_index_get(SIZE_GET(b->size));
+	struct pool * p = &a->table[index];
+
+	//Lock pool
+	lock_wait(&p->lock);
+
+	//First node
+	if (p->start == 0)
+	{
+		LINK_SET(b->pool_prev, NULL);
+		LINK_SET(b->pool_next, NULL);
+		LINK_SET(p->start, b);
+		LINK_SET(p->end, b);
+		p->size++;
+		__atomic_fetch_or(&a->table_map[index / 64], (uint64_t)1 << (index % 64), __ATOMIC_RELAXED);
+		lock_signal(&p->lock); //Unlock
+		return 0;
+	}
+
+	struct block_free * start = LINK_GET(p->start);
+	LINK_SET(b->pool_prev, NULL);
+	LINK_SET(b->pool_next, start);
+	LINK_SET(start->pool_prev, b);
+	LINK_SET(p->start, b);
+	p->size++;
+	pool_sort(a, b); //Sort
+
+	lock_signal(&p->lock); //Unlock
+	return 0;
+}
+
+/*
+ * @function pool_remove
+ * Removes node from pool, pool lock must be held
+ *
+ * @param struct mem_arena * a, struct block_free * b
+ * return int 0 success
+ */
+int pool_remove(struct mem_arena * a, struct block_free * b)
+{
+	if (b == NULL)
+		return -1;
+
+	unsigned int index = table_index_get(SIZE_GET(b->size));
+	struct pool * p = &a->table[index];
+	struct block_free * prev = LINK_GET(b->pool_prev);
+	struct block_free * next = LINK_GET(b->pool_next);
+	if (b == LINK_GET(p->start))
+		LINK_SET(p->start, next);
+
+	if (b == LINK_GET(p->end))
+		LINK_SET(p->end, prev);
+
+	if (prev != NULL)
+		LINK_SET(prev->pool_next, next);
+
+	if (next != NULL)
+		LINK_SET(next->pool_prev, prev);
+
+	LINK_SET(b->pool_prev, NULL);
+	LINK_SET(b->pool_next, NULL);
+
+	p->size--;
+
+	if (p->size == 0)
+		__atomic_fetch_and(&a->table_map[index / 64], ~((uint64_t)1 << (index % 64)), __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/*
+ * @function pool_search
+ * Finds free block >= size, pool lock must be held
+ *
+ * @param size_t s, struct pool * p
+ * @return struct block_free *
+ */
+struct block_free * pool_search(size_t s, struct pool * p)
+{
+	if (s == 0)
+		return NULL;
+
+	struct block_free * n = LINK_GET(p->start);
+	while (n != NULL)
+		if (SIZE_GET(n->size) >= s)
+			return n;
+		else
+			n = LINK_GET(n->pool_next);
+
+	return NULL;
+}
+
+/*
+ * @function pool_claim
+ * Takes a free block out of its pool and marks it used. Fails if another
+ * thread took it first. lock_heap must be held so the size can not change.
+ *
+ * @param struct mem_arena * a, struct block_free * b
+ * @return bool true if taken
+ */
+bool pool_claim(struct mem_arena * a, struct block_free * b)
+{
+	struct pool * p = &a->table[table_index_get(SIZE_GET(b->size))];
+	lock_wait(&p->lock);
+
+	bool taken = !SIZE_IS_USED(b->size);
+	if (taken)
+	{
+		pool_remove(a, b);
+		SIZE_STATE_SET(b->size, 1);
+	}
+
+	lock_signal(&p->lock);
+	return taken;
+}
+
+/*
+ * @function table_search
+ * Finds free block >= size in its own pool or the next pool holding blocks.
+ * The block is removed from its pool and marked used.
+ *
+ * @param struct mem_arena * a, size_t s
+ * @return struct block_free *
+ */
+struct block_free * table_search(struct mem_arena * a, size_t s)
+{
+	unsigned int index = table_index_get(s);
+	struct pool * p = &a->table[index];
+
+	lock_wait(&p->lock);
+	struct block_free * b = pool_search(s, p);
+	if (b != NULL)
+	{
+		pool_remove(a, b);
+		SIZE_STATE_SET(b->size, 1);
+	}
+	lock_signal(&p->lock);
+
+	if (b != NULL || index == CLASS_MAX)
+		return b;
+
+	//Every block in a higher pool is larger than s, map bits are only a hint
+	for (unsigned int i = index + 1; i <= CLASS_MAX; ++i)
+	{
+		uint64_t bits = __atomic_load_n(&a->table_map[i / 64], __ATOMIC_RELAXED) & (~(uint64_t)0 << (i % 64));
+		if (bits == 0)
+		{
+			i |= 63;
+			continue;
+		}
+
+		i = (i & ~63u) + (unsigned int)__builtin_ctzll(bits);
+		p = &a->table[i];
+
+		lock_wait(&p->lock);
+		b = LINK_GET(p->start);
+		if (b != NULL)
+		{
+			pool_remove(a, b);
+			SIZE_STATE_SET(b->size, 1);
+		}
+		lock_signal(&p->lock);
+
+		if (b != NULL)
+			return b;
+	}
+
+	return NULL;
+}
+
+/*
+ * @function segment_insert
+ * Adds segment to segment_list. lock_heap must be held.
+ *
+ * @param struct mem_arena * a, struct segment * s
+ */
+void segment_insert(struct mem_arena * a, struct segment * s)
+{
+	struct segment * next = LINK_GET(a->segment_list);
+	LINK_SET(s->prev, NULL);
+	LINK_SET(s->next, next);
+	if (next != NULL)
+		LINK_SET(next->prev, s);
+	LINK_SET(a->segment_list, s);
+}
+
+/*
+ * @function segment_remove
+ * Removes segment from segment_list. lock_heap must be held.
+ *
+ * @param struct mem_arena * a, struct segment * s
+ */
+void segment_remove(struct mem_arena * a, struct segment * s)
+{
+	struct segment * prev = LINK_GET(s->prev);
+	struct segment * next = LINK_GET(s->next);
+	if (prev != NULL)
+		LINK_SET(prev->next, next);
+	else
+		LINK_SET(a->segment_list, next);
+
+	if (next != NULL)
+		LINK_SET(next->prev, prev);
+}
+
+/*
+ * @function block_grow
+ * Creates block of size at the top of sbrk heap or the region. lock_heap must be held.
+ *
+ * @param struct mem_arena * a, size_t size
+ * @return struct block *
+ */
+struct block * block_grow(struct mem_arena * a, size_t size)
+{
+	struct block * b;
+
+	//Create new block, with room for a segment in case the heap run is broken
+	size_t length = size + sizeof(struct segment) + sizeof(struct block);
+	struct segment * s = (struct segment *)arena_grow(a, length);
+
+	//Check alloc worked
+	if (s == NULL)
+		return NULL;
+
+	PROBE2(heap_grow, s, length);
+	//Only chain blocks next to each other, sbrk may have been called by others
+	struct block * last = LINK_GET(a->block_last);
+	if (last != NULL && (void *)last + sizeof(struct block) + SIZE_GET(last->size) == (void *)s)
+	{
+		b = (struct block *)s;
+		size += sizeof(struct segment);
+	}
+	else
+	{
+		last = NULL;
+		segment_insert(a, s);
+		b = (struct block *)(s + 1);
+	}
+
+	SIZE_ZERO_SET(b->size, 1);
+
+	if (last != NULL)
+		LINK_SET(last->block_next, b);
+
+	LINK_SET(b->block_prev, last);
+	LINK_SET(a->block_last, b);
+
+	LINK_SET(b->block_next, NULL);
+	SIZE_SET(b->size, size);
+	SIZE_STATE_SET(b->size, 1);
+	return b;
+}
+
+/*
+ * @function block_remove
+ * Removes block and returns it to the system. Block must be a whole mapping
+ * or the top of the heap. The top keeps headroom bytes, only whole pages above
+ * it are returned and the block stays. lock_heap must be held.
+ *
+ * @param struct mem_arena * a, struct block_free * b
+ * @return int 0 success, -1 on fail or block kept, 2 if block is not the whole mapping
+ */
+int block_remove(struct mem_arena * a, struct block_free * b)
+{
+	if (SIZE_IS_MAPPED(b->size))
+	{
+		if (b->block_prev != 0 || b->block_next != 0)
+			return 2;
+
+		struct segment * s = (struct segment *)b - 1;
+		size_t length = SIZE_GET(b->size) + sizeof(struct block) + sizeof(struct segment);
+		segment_remove(a, s);
+		if (page_unmap((void *)s, length))
+		{
+			segment_insert(a, s);
+			return -1;
+		}
+
+		PROBE2(heap_trim, s, length);
+		return 0;
+	}
+
+	if ((struct block *)b != LINK_GET(a->block_last))
+		return -1;
+
+	//Keep headroom, whole pages above it are given back
+	if (a->headroom != 0)
+	{
+		size_t page = page_size_get();
+		if (SIZE_GET(b->size) < a->headroom + page)
+			return -1;
+
+		size_t keep = SIZE_GET(b->size) - ((SIZE_GET(b->size) - a->headroom) & ~(page - 1));
+		if (arena_shrink(a, (void *)b + sizeof(struct block) + keep, SIZE_GET(b->size) - keep) == 0)
+		{
+			PROBE2(heap_trim, (void *)b + sizeof(struct block) + keep, SIZE_GET(b->size) - keep);
+			SIZE_SET(b->size, keep);
+		}
+
+		return -1;
+	}
+
+	//First block of a heap run goes with its segment
+	struct block * prev = LINK_GET(b->block_prev);
+	void * start = (prev == NULL)? (void *)((struct segment *)b - 1) : (void *)b;
+	if (prev == NULL)
+		segment_remove(a, (struct segment *)start);
+
+	size_t length = (size_t)((void *)b - start) + SIZE_GET(b->size) + sizeof(struct block);
+	if (arena_shrink(a, start, length))
+	{
+		if (prev == NULL)
+			segment_insert(a, (struct segment *)start);
+		return -1;
+	}
+
+	PROBE2(heap_trim, start, length);
+	LINK_SET(a->block_last, prev);
+
+	if (prev != NULL)
+		LINK_SET(prev->block_next, NULL);
+
+	return 0;
+}
+
+/*
+ * @function block_split
+ * Splits free block into a block = to size and a free block. Free block is added to a pool.
+ * lock_heap must be held.
+ *
+ * @param struct mem_arena * a, size_t size, struct block_free * b (block not in pool)
+ * @return struct block *
+ */
+struct block * block_split(struct mem_arena * a, size_t size, struct block_free * b)
+{
+	if (size == 0 || b == NULL)
+		return NULL;
+
+	//Check if size if < b->size and that a free block will fit
+	if (size + sizeof(struct block_free) > SIZE_GET(b->size))
+		return NULL;
+
+	struct block * n = (struct block *)b;
+
+	//Remainder keeps the zero state, its header sits in the part handed out
+	b = (struct block_free *)((size_t)b + sizeof(struct block) + size);
+	b->size = 0;
+	SIZE_SET(b->size, SIZE_GET(n->size) - (size + sizeof(struct block)));
+	SIZE_STATE_SET(b->size, 0);
+	SIZE_ZERO_SET(b->size, SIZE_IS_ZERO(n->size));
+	struct block * next = LINK_GET(n->block_next);
+	LINK_SET(b->block_prev, n);
+	LINK_SET(b->block_next, next);
+
+	if (next != NULL)
+		LINK_SET(next->block_prev, b);
+
+	if (n == LINK_GET(a->block_last))
+		LINK_SET(a->block_last, b);
+
+	LINK_SET(n->block_next, b);
+	SIZE_SET(n->size, size);
+	SIZE_STATE_SET(n->size, 1);
+	PROBE3(block_split, n, size, SIZE_GET(b->size));
+
+	if (pool_insert(a, b) == -1)
+		return NULL;
+
+	return n;
+}
+
+/*
+ * @function block_create
+ * Creates block >= size. Memory is retrieved from sbrk or the region, or from mmap for the
+ * mmap backend and blocks >= mmap_threshold. lock_heap must be held.
+ *
+ * @param struct mem_arena * a, size_t size
+ * @return struct block *
+ */
+struct block * block_create(struct mem_arena * a, size_t size)
+{
+	struct block * b;
+
+	if (a->kind == ARENA_HEAP && (a->backend == BACKEND_MMAP || size >= config.mmap_threshold))
+	{
+		//Whole mapping is one block, at least map_min bytes
+		size_t page = page_size_get();
+		size_t length = (size + sizeof(struct segment) + sizeof(struct block) + page - 1) & ~(page - 1);
+		if (length < a->map_min)
+			length = a->map_min;
+
+		struct segment * s = (struct segment *)page_map(length);
+		if (s == NULL)
+			return NULL;
+
+		if (a->populate)
+			page_populate((void *)s, length, false);
+
+		PROBE2(heap_grow, s, length);
+		segment_insert(a, s);
+		b = (struct block *)(s + 1);
+		b->size = 0;
+		SIZE_ZERO_SET(b->size, 1);
+		SIZE_MAPPED_SET(b->size, 1);
+		LINK_SET(b->block_prev, NULL);
+		LINK_SET(b->block_next, NULL);
+		SIZE_SET(b->size, length - sizeof(struct segment) - sizeof(struct block));
+		SIZE_STATE_SET(b->size, 1);
+		return b;
+	}
+
+	if (a->headroom < BLOCK_SIZE_MIN)
+		return block_grow(a, size);
+
+	//Grow by headroom too, the rest is left free and faulted in
+	b = block_grow(a, size + sizeof(struct block) + a->headroom);
+	if (b == NULL)
+		return block_grow(a, size);
+
+	page_populate((void *)b + sizeof(struct block), SIZE_GET(b->size), false);
+	return block_split(a, size, (struct block_free *)b);
+}
+
+/*
+ * @function block_join
+ * Joins with right and left free blocks and removes them from pools.
+ * Joined block is not added to a pool. lock_heap must be held.
+ *
+ * @param struct mem_arena * a, struct block_free * b (block not in pool)
+ * @returns struct block_free * joined block, NULL on fail
+ */
+struct block_free * block_join(struct mem_arena * a, struct block_free * b)
+{
+	if (b == NULL || SIZE_IS_USED(b->size))
+		return NULL;
+
+	//Join with right
+	struct block_free * r = LINK_GET(b->block_next);
+	if (r != NULL && !SIZE_IS_USED(r->size) && pool_claim(a, r))
+	{
+		SIZE_SET(b->size, SIZE_GET(b->size) + sizeof(struct block) + SIZE_GET(r->size));
+		SIZE_ZERO_SET(b->size, 0);
+
+		struct block * next = LINK_GET(r->block_next);
+		LINK_SET(b->block_next, next);
+		if (next != NULL)
+			LINK_SET(next->block_prev, b);
+
+		if ((struct block *)r == LINK_GET(a->block_last))
+			LINK_SET(a->block_last, b);
+	}
+
+	//Join with left
+	struct block_free * left = LINK_GET(b->block_prev);
+	if (left != NULL && !SIZE_IS_USED(left->size) && pool_claim(a, left))
+	{
+		SIZE_SET(left->size, SIZE_GET(left->size) + sizeof(struct block) + SIZE_GET(b->size));
+		SIZE_STATE_SET(left->size, 0);
+		SIZE_ZERO_SET(left->size, 0);
+
+		struct block * next = LINK_GET(b->block_next);
+		LINK_SET(left->block_next, next);
+		if (next != NULL)
+			LINK_SET(next->block_prev, left);
+
+		if ((struct block *)b == LINK_GET(a->block_last))
+			LINK_SET(a->block_last, left);
+
+		b = left;
+	}
+
+	PROBE2(block_join, b, SIZE_GET(b->size));
+	return b;
+}
+
+/*
+ * @function heap_decay
+ * Trims the top of the heap once it has been free for config.decay ms.
+ * lock_heap must be held.
+ *
+ * @param struct mem_arena * a
+ */
+void heap_decay(struct mem_arena * a)
+{
+	if (config.decay <= 0)
+		return;
+
+	struct block_free * b = LINK_GET(a->block_last);
+	if (b == NULL || SIZE_IS_USED(b->size))
+	{
+		a->decay_start = 0;
+		return;
+	}
+
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &t);
+	size_t now = (size_t)t.tv_sec * 1000 + (size_t)t.tv_nsec / 1000000 + 1;
+
+	if (a->decay_start == 0)
+		a->decay_start = now;
+
+	if (now - a->decay_start < (size_t)config.decay)
+		return;
+
+	if (pool_claim(a, b) && block_remove(a, b) != 0)
+	{
+		SIZE_STATE_SET(b->size, 0);
+		pool_insert(a, b);
+	}
+
+	a->decay_start = 0;
+}
+
+/*
+ * @function block_put
+ * Marks block free, joins it with free neighbours and adds it to a pool, or
+ * returns it to the system. lock_heap must be held.
+ *
+ * @param struct mem_arena * a, struct block_free * b
+ */
+void block_put(struct mem_arena * a, struct block_free * b)
+{
+	//Payload was handed out so it is no longer known to be zero
+	SIZE_STATE_SET(b->size, 0);
+	SIZE_ZERO_SET(b->size, 0);
+
+	//Join block
+	LINK_SET(b->pool_prev, NULL);
+	LINK_SET(b->pool_next, NULL);
+	b = block_join(a, b);
+
+	//Return whole mappings and the top of the heap to the system
+	if ((SIZE_IS_MAPPED(b->size) || config.decay == 0) && block_remove(a, b) == 0)
+		return;
+
+	pool_insert(a, b);
+}
+
+/*
+ * @function fast_flush
+ * Joins every block waiting in fast lists. lock_heap must be held.
+ *
+ * @param struct mem_arena * a
+ */
+void fast_flush(struct mem_arena * a)
+{
+	for (unsigned int i = 0; i <= CLASS_MAX; ++i)
+	{
+		struct pool * p = &a->table[i];
+		if (p->fast == 0)
+			continue;
+
+		lock_wait(&p->lock);
+		struct block_free * b = LINK_GET(p->fast);
+		LINK_SET(p->fast, NULL);
+		p->fast_size = 0;
+		lock_signal(&p->lock);
+
+		while (b != NULL)
+		{
+			struct block_free * next = LINK_GET(b->pool_next);
+			__atomic_fetch_sub(&a->fast_bytes, SIZE_GET(b->size) + sizeof(struct block), __ATOMIC_RELAXED);
+			block_put(a, b);
+			b = next;
+		}
+	}
+}
+
+/*
+ * @function fast_index
+ * Pool whose fast list takes a block, the largest class it can serve without
+ * joining it. Blocks above TABLE_SIZE have no class to serve.
+ *
+ * @param size_t size
+ * @return unsigned int index, CLASS_MAX if none
+ */
+unsigned int fast_index(size_t size)
+{
+	unsigned int index = table_index_get(size);
+	if (index != CLASS_MAX && table_class_size[index] > size)
+		index = (index == 0)? CLASS_MAX : index - 1;
+
+	return index;
+}
+
+/*
+ * @function fast_push
+ * Adds used block to the fast list of the largest class it can serve without
+ * joining it. Joins all fast lists once fast_limit bytes are waiting.
+ *
+ * @param struct mem_arena * a, struct block_free * b
+ * @return bool true if added
+ */
+bool fast_push(struct mem_arena * a, struct block_free * b)
+{
+	size_t size = SIZE_GET(b->size);
+	unsigned int index = fast_index(size);
+	if (index == CLASS_MAX)
+		return false;
+
+	struct pool * p = &a->table[index];
+	SIZE_ZERO_SET(b->size, 0);
+
+	lock_wait(&p->lock);
+	struct block_free * next = LINK_GET(p->fast);
+	LINK_SET(b->pool_next, next);
+	LINK_SET(p->fast, b);
+	p->fast_size++;
+	lock_signal(&p->lock);
+
+	if (__atomic_add_fetch(&a->fast_bytes, size + sizeof(struct block), __ATOMIC_RELAXED) > config.fast_limit)
+	{
+		lock_wait(&a->lock_heap);
+		fast_flush(a);
+		heap_decay(a);
+		lock_signal(&a->lock_heap);
+	}
+
+	return true;
+}
+
+/*
+ * @function fast_pop
+ * Takes the last freed block of the class of size.
+ *
+ * @param struct mem_arena * a, size_t size (class size)
+ * @return struct block_free * used block, NULL if none
+ */
+struct block_free * fast_pop(struct mem_arena * a, size_t size)
+{
+	struct pool * p = &a->table[table_index_get(size)];
+	if (p->fast == 0)
+		return NULL;
+
+	lock_wait(&p->lock);
+	struct block_free * b = LINK_GET(p->fast);
+	if (b != NULL)
+	{
+		struct block_free * next = LINK_GET(b->pool_next);
+		LINK_SET(p->fast, next);
+		p->fast_size--;
+	}
+	lock_signal(&p->lock);
+
+	if (b != NULL)
+		__atomic_fetch_sub(&a->fast_bytes, SIZE_GET(b->size) + sizeof(struct block), __ATOMIC_RELAXED);
+
+	return b;
+}
+
+/*
+ * @function arena_drain
+ * Takes every free block out of the pools of arena. lock_heap must be held.
+ *
+ * @param struct mem_arena * a, struct block_free * list (blocks linked by pool_next)
+ * @return struct block_free * list with the blocks added
+ */
+struct block_free * arena_drain(struct mem_arena * a, struct block_free * list)
+{
+	fast_flush(a);
+
+	for (unsigned int i = 0; i <= CLASS_MAX; ++i)
+	{
+		lock_wait(&a->table[i].lock);
+		while (a->table[i].start != 0)
+		{
+			struct block_free * b = LINK_GET(a->table[i].start);
+			pool_remove(a, b);
+			LINK_SET(b->pool_next, list);
+			list = b;
+		}
+		lock_signal(&a->table[i].lock);
+	}
+
+	return list;
+}
+
+/*
+ * @function arena_free
+ * Frees used block into arena, small blocks are joined later.
+ *
+ * @param struct mem_arena * a, struct block_free * b
+ */
+void arena_free(struct mem_arena * a, struct block_free * b)
+{
+	if (SIZE_GET(b->size) <= a->fast_max && !SIZE_IS_MAPPED(b->size) && fast_push(a, b))
+	{
+		//Heap top waiting to be trimmed
+		if (__atomic_load_n(&a->decay_start, __ATOMIC_RELAXED) != 0)
+		{
+			lock_wait(&a->lock_heap);
+			heap_decay(a);
+			lock_signal(&a->lock_heap);
+		}
+		return;
+	}
+
+	lock_wait(&a->lock_heap);
+	block_put(a, b);
+	heap_decay(a);
+	lock_signal(&a->lock_heap);
+}
+
+/*
+ * @function tcache_flush
+ * Frees blocks of a bin of the calling thread's cache into the main arena.
+ *
+ * @param unsigned int bin, unsigned int keep (blocks left in the bin)
+ */
+void tcache_flush(unsigned int bin, unsigned int keep)
+{
+	struct mem_tcache * c = &mem_tcache;
+	while (c->count[bin] > keep)
+	{
+		void * address = c->bin[bin];
+		c->bin[bin] = *(void **)address;
+		c->count[bin]--;
+		arena_free(&arena_main, (struct block_free *)(address - sizeof(struct block)));
+	}
+}
+
+/*
+ * @function tcache_exit
+ * Thread exit destructor, empties the thread's cache.
+ *
+ * @param void * data (struct mem_tcache *)
+ */
+void tcache_exit(void * data)
+{
+	(void)data;
+	for (unsigned int i = 0; i < MEM_TCACHE_BINS; ++i)
+		tcache_flush(i, 0);
+
+	mem_tcache.registered = 0;
+}
+
+/*
+ * @function epoch_limbo_merge
+ * Adds a limbo list to the list in the slot of its epoch. The merged list is
+ * kept until the later of both epochs is safe.
+ *
+ * @param struct epoch_bag ** limbo, size_t * limbo_epoch, struct epoch_bag * list, size_t epoch
+ */
+void epoch_limbo_merge(struct epoch_bag ** limbo, size_t * limbo_epoch, struct epoch_bag * list, size_t epoch)
+{
+	if (list == NULL)
+		return;
+
+	unsigned int i = epoch % 3;
+	struct epoch_bag * tail = list;
+	while (tail->next != NULL)
+		tail = tail->next;
+
+	if (limbo[i] == NULL || limbo_epoch[i] < epoch)
+		limbo_epoch[i] = epoch;
+
+	tail->next = limbo[i];
+	__atomic_store_n(&limbo[i], list, __ATOMIC_RELAXED);
+}
+
+/*
+ * @function epoch_thread_exit
+ * Thread exit destructor, hands the thread's limbo lists over and frees its record
+ * for the next thread.
+ *
+ * @param void * data (struct epoch_thread *)
+ */
+void epoch_thread_exit(void * data)
+{
+	struct epoch_thread * t = (struct epoch_thread *)data;
+
+	lock_wait(&lock_epoch);
+	for (unsigned int i = 0; i < 3; ++i)
+	{
+		epoch_limbo_merge(epoch_orphan, epoch_orphan_epoch, t->limbo[i], t->limbo_epoch[i]);
+		t->limbo[i] = NULL;
+	}
+	lock_signal(&lock_epoch);
+
+	t->nest = 0;
+	t->count = 0;
+	epoch_self = NULL;
+	__atomic_store_n(&t->epoch, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&t->taken, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * @function tcache_push
+ * Keeps used block of the main arena in a bin of the calling thread's cache. A
+ * full bin is halved first.
+ *
+ * @param struct block_free * b, unsigned int bin (<= size / MEM_TCACHE_STEP)
+ * @return bool true if kept
+ */
+bool tcache_push(struct block_free * b, unsigned int bin)
+{
+	struct mem_tcache * c = &mem_tcache;
+	if (config.cache == 0)
+		return false;
+
+	//Destructor hands the cache back when the thread exits
+	if (c->registered == 0)
+	{
+		if (pthread_setspecific(tcache_key, c) != 0)
+			return false;
+
+		c->registered = 1;
+	}
+
+	if (c->count[bin] >= config.cache)
+		tcache_flush(bin, config.cache / 2);
+
+	void * address = (void *)b + sizeof(struct block);
+	SIZE_ZERO_SET(b->size, 0);
+	*(void **)address = c->bin[bin];
+	c->bin[bin] = address;
+	c->count[bin]++;
+	return true;
+}
+
+/*
+ * @function async_run
+ * Frees a batch taken from the queue.
+ *
+ * @param void * list
+ * @return size_t blocks freed
+ */
+size_t async_run(void * list)
+{
+	size_t count = 0;
+	while (list != NULL)
+	{
+		void ** node = (void **)list;
+		list = node[0];
+
+		struct block_free * b = (struct block_free *)((void *)node - sizeof(struct block));
+		__atomic_fetch_sub(&async_bytes, SIZE_GET(b->size), __ATOMIC_RELAXED);
+		arena_free((struct mem_arena *)node[1], b);
+		count++;
+	}
+
+	return count;
+}
+
+/*
+ * @function async_worker
+ * Background free thread, takes the whole queue at once and sleeps while it is
+ * empty or a fork is under way.
+ *
+ * @param void * data (unused)
+ * @return void * NULL
+ */
+void * async_worker(void * data)
+{
+	(void)data;
+
+	//Signals go to program threads
+	sigset_t signals;
+	sigfillset(&signals);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	while (true)
+	{
+		pthread_mutex_lock(&async_mutex);
+		__atomic_store_n(&async_sleeping, true, __ATOMIC_SEQ_CST);
+		while (async_forking || __atomic_load_n(&async_queue, __ATOMIC_SEQ_CST) == NULL)
+			pthread_cond_wait(&async_wake, &async_mutex);
+		__atomic_store_n(&async_sleeping, false, __ATOMIC_RELAXED);
+
+		async_busy = true;
+		void * list = __atomic_exchange_n(&async_queue, NULL, __ATOMIC_ACQUIRE);
+		pthread_mutex_unlock(&async_mutex);
+
+		size_t count = async_run(list);
+
+		//Wakes flushes and a fork waiting for the batch
+		pthread_mutex_lock(&async_mutex);
+		async_busy = false;
+		__atomic_add_fetch(&async_done, count, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&async_flushed);
+		pthread_mutex_unlock(&async_mutex);
+	}
+
+	return NULL;
+}
+
+/*
+ * @function async_push
+ * Queues the free of a large or mapped block for the background thread. Past
+ * config.async_limit queued bytes the caller frees it itself.
+ *
+ * @param struct mem_arena * a, struct block_free * b
+ * @return bool true if queued
+ */
+bool async_push(struct mem_arena * a, struct block_free * b)
+{
+	size_t size = SIZE_GET(b->size);
+	if (!__atomic_load_n(&async_started, __ATOMIC_ACQUIRE) || (size < config.async_min && !SIZE_IS_MAPPED(b->size)))
+		return false;
+
+	if (__atomic_add_fetch(&async_bytes, size, __ATOMIC_RELAXED) > config.async_limit)
+	{
+		__atomic_fetch_sub(&async_bytes, size, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	//Counted before it is pushed so a flush started after this free waits for it
+	__atomic_add_fetch(&async_queued, 1, __ATOMIC_RELAXED);
+
+	void ** node = (void **)((void *)b + sizeof(struct block));
+	node[1] = a;
+	node[0] = __atomic_load_n(&async_queue, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&async_queue, &node[0], node, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+	//Only a sleeping thread costs a wake up
+	if (__atomic_load_n(&async_sleeping, __ATOMIC_SEQ_CST))
+	{
+		pthread_mutex_lock(&async_mutex);
+		pthread_cond_signal(&async_wake);
+		pthread_mutex_unlock(&async_mutex);
+	}
+
+	return true;
+}
+
+/*
+ * @function async_start
+ * Starts the background free thread, frees stay inline if it can not be started.
+ */
+void async_start(void)
+{
+	pthread_attr_t attr;
+	if (pthread_attr_init(&attr) != 0)
+		return;
+
+	pthread_t thread;
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, async_worker, NULL) == 0)
+		__atomic_store_n(&async_started, true, __ATOMIC_RELEASE);
+
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * @function async_fork_prepare
+ * Waits for the background thread to finish its batch and keeps it from taking
+ * another until the fork is done.
+ */
+void async_fork_prepare(void)
+{
+	pthread_mutex_lock(&async_mutex);
+	async_forking = true;
+	while (async_busy)
+		pthread_cond_wait(&async_flushed, &async_mutex);
+}
+
+/*
+ * @function async_fork_parent
+ * Lets the background thread go on after fork.
+ */
+void async_fork_parent(void)
+{
+	async_forking = false;
+	pthread_cond_signal(&async_wake);
+	pthread_mutex_unlock(&async_mutex);
+}
+
+/*
+ * @function async_fork_child
+ * The child has no background thread. Frees queued in the parent are done
+ * inline, the queue state is reset and a new thread is started.
+ */
+void async_fork_child(void)
+{
+	pthread_mutex_init(&async_mutex, NULL);
+	pthread_cond_init(&async_wake, NULL);
+	pthread_cond_init(&async_flushed, NULL);
+
+	async_run(__atomic_exchange_n(&async_queue, NULL, __ATOMIC_ACQUIRE));
+	async_started = false;
+	async_sleeping = false;
+	async_busy = false;
+	async_forking = false;
+	async_bytes = 0;
+	async_queued = 0;
+	async_done = 0;
+
+	async_start();
+}
+
+/*
+ * @function table_class_apply
+ * Sets size classes and moves free blocks of every arena to their new pools.
+ * Classes can not change while a shared arena is mapped, other processes bin
+ * its blocks by them.
+ *
+ * @param const unsigned int * bounds, unsigned int count
+ * @return int 0 success, -1 invalid classes or a shared arena is mapped
+ */
+int table_class_apply(const unsigned int * bounds, unsigned int count)
+{
+	if (bounds == NULL || count == 0 || count > CLASS_MAX || bounds[count - 1] != TABLE_SIZE)
+		return -1;
+
+	for (unsigned int i = 0; i < count; ++i)
+		if (bounds[i] == 0 || bounds[i] % CLASS_STEP != 0 || (i > 0 && bounds[i] <= bounds[i - 1]))
+			return -1;
+
+	//Only place more than one arena is locked, always in list order
+	lock_wait(&lock_arenas);
+	for (struct arena_map * m = arena_map_next(&arena_maps); m != NULL; m = arena_map_next(m))
+		if (m->arena->kind == ARENA_SHARED)
+		{
+			lock_signal(&lock_arenas);
+			return -1;
+		}
+
+	struct block_free * list = NULL;
+	for (struct arena_map * m = &arena_maps; m != NULL; m = arena_map_next(m))
+	{
+		lock_wait(&m->arena->lock_heap);
+		list = arena_drain(m->arena, list);
+	}
+
+	//Hint arenas cannot be found by address, each keeps its own list
+	struct block_free * hint_list[ARENA_HINTS];
+	unsigned int hints = (config.arenas - 1 < ARENA_HINTS)? config.arenas - 1 : ARENA_HINTS;
+	for (unsigned int i = 0; i < hints; ++i)
+	{
+		lock_wait(&arena_hint[i].lock_heap);
+		hint_list[i] = arena_drain(&arena_hint[i], NULL);
+	}
+
+	table_class_set(bounds, count);
+
+	while (list != NULL)
+	{
+		struct block_free * next = LINK_GET(list->pool_next);
+		pool_insert(arena_find(list), list);
+		list = next;
+	}
+
+	for (unsigned int i = 0; i < hints; ++i)
+	{
+		while (hint_list[i] != NULL)
+		{
+			struct block_free * next = LINK_GET(hint_list[i]->pool_next);
+			pool_insert(&arena_hint[i], hint_list[i]);
+			hint_list[i] = next;
+		}
+
+		arena_hint[i].header.classes = table_class_signature();
+		lock_signal(&arena_hint[i].lock_heap);
+	}
+
+	for (struct arena_map * m = &arena_maps; m != NULL; m = arena_map_next(m))
+	{
+		m->arena->header.classes = table_class_signature();
+		lock_signal(&m->arena->lock_heap);
+	}
+
+	lock_signal(&lock_arenas);
+	return 0;
+}
+
+/*
+ * @function arena_lock_pools
+ * Locks or unlocks the heap and every pool of arena.
+ *
+ * @param struct mem_arena * a, bool lock (false unlocks)
+ */
+void arena_lock_pools(struct mem_arena * a, bool lock)
+{
+	if (lock)
+	{
+		lock_wait(&a->lock_heap);
+		for (unsigned int i = 0; i <= CLASS_MAX; ++i)
+			lock_wait(&a->table[i].lock);
+		return;
+	}
+
+	for (unsigned int i = 0; i <= CLASS_MAX; ++i)
+		lock_signal(&a->table[i].lock);
+	lock_signal(&a->lock_heap);
+}
+
+/*
+ * @function arena_lock_all
+ * Locks or unlocks every arena of this process in the order of table_class_apply.
+ * Shared arenas are left alone, other processes hold them too.
+ *
+ * @param bool lock (false unlocks)
+ */
+void arena_lock_all(bool lock)
+{
+	if (lock)
+		lock_wait(&lock_arenas);
+
+	for (struct arena_map * m = &arena_maps; m != NULL; m = arena_map_next(m))
+		if (m->arena->kind != ARENA_SHARED)
+			arena_lock_pools(m->arena, lock);
+
+	unsigned int hints = (config.arenas - 1 < ARENA_HINTS)? config.arenas - 1 : ARENA_HINTS;
+	for (unsigned int i = 0; i < hints; ++i)
+		arena_lock_pools(&arena_hint[i], lock);
+
+	if (!lock)
+		lock_signal(&lock_arenas);
+}
+
+/*
+ * @function arena_fork_prepare
+ * Holds every arena across fork so the child never gets a lock taken by a
+ * thread it does not have.
+ */
+void arena_fork_prepare(void)
+{
+	arena_lock_all(true);
+}
+
+/*
+ * @function arena_fork_release
+ * Unlocks the arenas in parent and child after fork.
+ */
+void arena_fork_release(void)
+{
+	arena_lock_all(false);
+}
+
+/*
+ * @function table_profile_read
+ * Reads size classes saved by mem_profile_save.
+ *
+ * @param const char * path, unsigned int * bounds (CLASS_MAX entries)
+ * @return int number of classes, -1 fail
+ */
+int table_profile_read(const char * path, unsigned int * bounds)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+
+	char text[CLASS_MAX * 8];
+	ssize_t length = read(fd, text, sizeof(text));
+	close(fd);
+	if (length <= 0)
+		return -1;
+
+	int count = 0;
+	unsigned long v = 0;
+	bool digit = false;
+	for (ssize_t i = 0; i <= length; ++i)
+	{
+		if (i < length && text[i] >= '0' && text[i] <= '9')
+		{
+			v = v * 10 + (unsigned long)(text[i] - '0');
+			digit = true;
+			continue;
+		}
+
+		if (digit)
+		{
+			if (count == CLASS_MAX || v > TABLE_SIZE)
+				return -1;
+
+			bounds[count++] = (unsigned int)v;
+		}
+
+		v = 0;
+		digit = false;
+	}
+
+	return count;
+}
+
+/*
+ * @function text_number
+ * Writes number as decimal text. Used where stdio could re-enter the allocator.
+ *
+ * @param char * text (>= 20 bytes), size_t v
+ * @return size_t length
+ */
+size_t text_number(char * text, size_t v)
+{
+	char digits[20];
+	size_t n = 0;
+	do
+		digits[n++] = (char)('0' + v % 10);
+	while ((v /= 10) != 0);
+
+	for (size_t i = 0; i < n; ++i)
+		text[i] = digits[n - 1 - i];
+
+	return n;
+}
+
+/*
+ * @function text_hex
+ * Writes number as 0x prefixed hexadecimal text.
+ *
+ * @param char * text (>= 18 bytes), size_t v
+ * @return size_t length
+ */
+size_t text_hex(char * text, size_t v)
+{
+	size_t n = sizeof(size_t) * 2;
+	while (n > 1 && (v >> ((n - 1) * 4)) == 0)
+		n--;
+
+	text[0] = '0';
+	text[1] = 'x';
+	for (size_t i = 0; i < n; ++i)
+		text[2 + i] = "0123456789abcdef"[(v >> ((n - 1 - i) * 4)) & 15];
+
+	return n + 2;
+}
+
+/*
+ * @function text_write
+ * Writes a message to stderr without stdio.
+ *
+ * @param const char * a, size_t length a, const char * b, size_t length b
+ */
+void text_write(const char * a, size_t a_length, const char * b, size_t b_length)
+{
+	char text[512];
+	size_t n = 0;
+
+	#define TEXT_ADD(s, l) for (size_t i = 0; i < (l) && n < sizeof(text) - 1; ++i) text[n++] = (s)[i]
+	TEXT_ADD("gpmalloc: ", 10);
+	TEXT_ADD(a, a_length);
+	TEXT_ADD(b, b_length);
+	#undef TEXT_ADD
+
+	text[n++] = '\n';
+	if (write(2, text, n) < 0)
+		return;
+}
+
+/*
+ * @function config_size
+ * Reads size with optional k, m or g suffix.
+ *
+ * @param const char * value, size_t length, size_t * out
+ * @return bool true if valid, false if not a size or it does not fit size_t
+ */
+bool config_size(const char * value, size_t length, size_t * out)
+{
+	size_t v = 0;
+	size_t i = 0;
+	for (; i < length && value[i] >= '0' && value[i] <= '9'; ++i)
+		if (__builtin_mul_overflow(v, 10, &v) || __builtin_add_overflow(v, (size_t)(value[i] - '0'), &v))
+			return false;
+
+	if (i == 0)
+		return false;
+
+	unsigned int shift = 0;
+	if (i + 1 == length)
+		switch (value[i])
+		{
+			case 'k': case 'K': shift = 10; i++; break;
+			case 'm': case 'M': shift = 20; i++; break;
+			case 'g': case 'G': shift = 30; i++; break;
+		}
+
+	if (v > (SIZE_MAX >> shift))
+		return false;
+
+	v <<= shift;
+
+	*out = v;
+	return i == length;
+}
+
+/*
+ * @function config_parse
+ * Reads options in the form "key:value,key:value". Does not allocate, invalid
+ * options are reported on stderr and skipped.
+ *
+ * backend:sbrk|mmap        heap from sbrk or mmap segments
+ * arenas:n                 main arena and arenas for lifetime hints, 1 to 4
+ * cache:n                  blocks kept per class in a thread cache
+ * mmap_threshold:size      blocks >= size get their own mapping (k, m, g suffix)
+ * decay:ms                 time the free heap top is kept before trimming, -1 never
+ * hugepage:default|always|never
+ * page_min:n               minimum pages per mapping
+ * fast_max:size            frees of blocks <= size are joined later, 0 joins at once
+ * fast_limit:size          bytes waiting to be joined before all are joined
+ * headroom:size            free bytes kept faulted in on top of the heap
+ * prewarm:size             bytes faulted in on top of the heap once set up
+ * prewarm_blocks:n         blocks cut per class up to PREWARM_CLASS_MAX once set up
+ * async_min:size           frees of blocks >= size and of mapped blocks are done by a thread, 0 none
+ * async_limit:size         queued bytes past which frees are done inline again
+ * profile:path             size classes from mem_profile_save
+ * debug:0|1                print configuration on start
+ *
+ * @param const char * text
+ * @return int number of invalid options
+ */
+int config_parse(const char * text)
+{
+	int errors = 0;
+
+	while (text != NULL && *text != '\0')
+	{
+		//Split "key:value"
+		const char * key = text;
+		size_t length = 0;
+		while (key[length] != '\0' && key[length] != ',')
+			length++;
+
+		text = (key[length] == ',')? key + length + 1 : key + length;
+
+		size_t key_length = 0;
+		while (key_length < length && key[key_length] != ':')
+			key_length++;
+
+		if (key_length == length)
+		{
+			if (length > 0)
+			{
+				text_write("invalid option ", 15, key, length);
+				errors++;
+			}
+			continue;
+		}
+
+		const char * value = key + key_length + 1;
+		size_t value_length = length - key_length - 1;
+		size_t v;
+		bool valid = true;
+
+		#define KEY_IS(s) (key_length == sizeof(s) - 1 && memcmp(key, s, key_length) == 0)
+		#define VALUE_IS(s) (value_length == sizeof(s) - 1 && memcmp(value, s, value_length) == 0)
+		if (KEY_IS("backend") && VALUE_IS("sbrk"))
+			config.backend = BACKEND_SBRK;
+		else if (KEY_IS("backend") && VALUE_IS("mmap"))
+			config.backend = BACKEND_MMAP;
+		else if (KEY_IS("hugepage") && VALUE_IS("default"))
+			config.hugepage = HUGEPAGE_DEFAULT;
+		else if (KEY_IS("hugepage") && VALUE_IS("always"))
+			config.hugepage = HUGEPAGE_ALWAYS;
+		else if (KEY_IS("hugepage") && VALUE_IS("never"))
+			config.hugepage = HUGEPAGE_NEVER;
+		else if (KEY_IS("decay") && VALUE_IS("-1"))
+			config.decay = -1;
+		else if (KEY_IS("profile") && value_length < sizeof(config.profile))
+		{
+			memcpy(config.profile, value, value_length);
+			config.profile[value_length] = '\0';
+		}
+		else if (!config_size(value, value_length, &v))
+			valid = false;
+		else if (KEY_IS("arenas") && v > 0 && v <= ARENA_HINTS + 1)
+			config.arenas = (unsigned int)v;
+		else if (KEY_IS("cache") && v <= UINT_MAX)
+			config.cache = (unsigned int)v;
+		else if (KEY_IS("mmap_threshold"))
+			config.mmap_threshold = v;
+		else if (KEY_IS("decay") && v <= LONG_MAX)
+			config.decay = (long)v;
+		else if (KEY_IS("page_min") && v > 0)
+			config.page_min = v;
+		else if (KEY_IS("fast_max"))
+			config.fast_max = v;
+		else if (KEY_IS("fast_limit"))
+			config.fast_limit = v;
+		else if (KEY_IS("headroom"))
+			config.headroom = SIZE_ALIGN(v);
+		else if (KEY_IS("prewarm"))
+			config.prewarm = v;
+		else if (KEY_IS("prewarm_blocks"))
+			config.prewarm_blocks = v;
+		else if (KEY_IS("async_min"))
+			config.async_min = v;
+		else if (KEY_IS("async_limit"))
+			config.async_limit = v;
+		else if (KEY_IS("debug"))
+			config.debug = (v != 0);
+		else
+			valid = false;
+		#undef KEY_IS
+		#undef VALUE_IS
+
+		if (!valid)
+		{
+			text_write("invalid option ", 15, key, length);
+			errors++;
+		}
+	}
+
+	return errors;
+}
+
+/*
+ * @function config_print
+ * Writes configuration to stderr.
+ */
+void config_print(void)
+{
+	char text[24];
+
+	text_write("backend:", 8, (config.backend == BACKEND_SBRK)? "sbrk" : "mmap", 4);
+	text_write("hugepage:", 9, (config.hugepage == HUGEPAGE_DEFAULT)? "default" : (config.hugepage == HUGEPAGE_ALWAYS)? "always" : "never",
+	           (config.hugepage == HUGEPAGE_DEFAULT)? 7 : (config.hugepage == HUGEPAGE_ALWAYS)? 6 : 5);
+	text_write("arenas:", 7, text, text_number(text, config.arenas));
+	text_write("cache:", 6, text, text_number(text, config.cache));
+	text_write("mmap_threshold:", 15, text, text_number(text, config.mmap_threshold));
+	text_write("page_min:", 9, text, text_number(text, config.page_min));
+	text_write("fast_max:", 9, text, text_number(text, config.fast_max));
+	text_write("fast_limit:", 11, text, text_number(text, config.fast_limit));
+	text_write("headroom:", 9, text, text_number(text, config.headroom));
+	text_write("prewarm:", 8, text, text_number(text, config.prewarm));
+	text_write("prewarm_blocks:", 15, text, text_number(text, config.prewarm_blocks));
+	text_write("async_min:", 10, text, text_number(text, config.async_min));
+	text_write("async_limit:", 12, text, text_number(text, config.async_limit));
+
+	if (config.decay < 0)
+		text_write("decay:", 6, "-1", 2);
+	else
+		text_write("decay:", 6, text, text_number(text, (size_t)config.decay));
+
+	text_write("profile:", 8, config.profile, strlen(config.profile));
+}
+
+/*
+ * @function init_run
+ * Sets up memory allocator pools and reads configuration from CONFIG_ENV. Run
+ * once, by the thread that moved init_state to INIT_RUNNING.
+ */
+void init_run(void)
+{
+	//Environment is read once, after options from mem_config
+	config_parse(getenv(CONFIG_ENV));
+	config_complete = true;
+
+	table_class_reset();
+	arena_main.kind = ARENA_HEAP;
+	arena_main.fast_max = config.fast_max;
+	arena_main.headroom = config.headroom;
+	arena_main.backend = config.backend;
+	arena_main.map_min = config.page_min * page_size_get();
+	arena_setup(&arena_main);
+
+	//Hint arenas take mappings so they never pin the sbrk heap
+	for (unsigned int i = 0; i < ARENA_HINTS && i + 1 < config.arenas; ++i)
+	{
+		struct mem_arena * a = &arena_hint[i];
+		a->kind = ARENA_HEAP;
+		a->fast_max = config.fast_max;
+		a->headroom = 0;
+		a->backend = BACKEND_MMAP;
+		a->map_min = (ARENA_HINT_MAP > arena_main.map_min)? ARENA_HINT_MAP : arena_main.map_min;
+		a->populate = (1U << i) == MEM_HOT;
+		arena_setup(a);
+	}
+
+	pthread_key_create(&tcache_key, tcache_exit);
+	pthread_key_create(&epoch_key, epoch_thread_exit);
+
+	//Arenas are locked after the background thread stops and unlocked before it starts again
+	pthread_atfork(arena_fork_prepare, arena_fork_release, arena_fork_release);
+	if (config.async_min != 0 && pthread_atfork(async_fork_prepare, async_fork_parent, async_fork_child) == 0)
+		async_start();
+
+	__atomic_store_n(&mem_tcache_limit, config.cache, __ATOMIC_RELAXED);
+
+	unsigned int bounds[CLASS_MAX];
+	int count = 0;
+	if (config.profile[0] != '\0' && ((count = table_profile_read(config.profile, bounds)) == -1 || table_class_apply(bounds, (unsigned int)count) == -1))
+		text_write("could not load profile ", 23, config.profile, strlen(config.profile));
+
+	if (config.debug)
+		config_print();
+}
+
+/*
+ * @function init_prewarm
+ * Cuts config.prewarm_blocks blocks of every class up to PREWARM_CLASS_MAX and
+ * faults in config.prewarm bytes on top of the heap, so early allocations
+ * neither split nor fault. Classes the thread cache serves are skipped, its
+ * bins are refilled by carving from the heap top.
+ */
+void init_prewarm(void)
+{
+	size_t size = (config.cache >= 2)? MEM_TCACHE_MAX + 1 : CLASS_STEP;
+	if (config.prewarm_blocks != 0)
+		for (; size <= PREWARM_CLASS_MAX; size = table_size_get(size) + 1)
+			mem_reserve_class(size, config.prewarm_blocks, 0);
+
+	if (config.prewarm != 0)
+		mem_reserve(config.prewarm, 0);
+}
+
+/*
+ * @function mem_init
+ * Sets up the allocator on first use. After that it is one acquire load, no
+ * lock is taken. Threads arriving while it is set up wait for it.
+ */
+void mem_init(void)
+{
+	if (__atomic_load_n(&init_state, __ATOMIC_ACQUIRE) == INIT_DONE)
+		return;
+
+	int state = INIT_NONE;
+	if (!__atomic_compare_exchange_n(&init_state, &state, INIT_RUNNING, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+	{
+		for (unsigned int delay = 1; __atomic_load_n(&init_state, __ATOMIC_ACQUIRE) != INIT_DONE;)
+			delay = lock_backoff(delay);
+		return;
+	}
+
+	init_run();
+	__atomic_store_n(&init_state, INIT_DONE, __ATOMIC_RELEASE);
+
+	//Reserving allocates, so it runs once the allocator is up
+	init_prewarm();
+}
+
+#ifdef USE_CONSTRUCTOR
+
+/*
+ * @function init_constructor
+ * Sets the allocator up before main, so no allocation pays for it.
+ */
+__attribute__((constructor)) void init_constructor(void)
+{
+	mem_init();
+}
+
+#endif //USE_CONSTRUCTOR
+
+/*
+ * @function mem_config
+ * Sets options in the same form as CONFIG_ENV. Must be called before the first
+ * allocation, the environment is read after and takes precedence.
+ *
+ * @param const char * options
+ * @return int 0 success, number of invalid options, -1 if allocator already started
+ */
+int mem_config(const char * options)
+{
+	if (config_complete)
+		return -1;
+
+	return config_parse(options);
+}
+
+/*
+ * @function block_get
+ * Finds or creates a used block >= size. Zero state of the block is kept.
+ *
+ * @param struct mem_arena * a, size_t size
+ * @return struct block *
+ */
+struct block * block_get(struct mem_arena * a, size_t size)
+{
+	//Larger sizes would spill into the flag bits
+	if (size > SIZE_MASK / 2)
+		return NULL;
+
+	//Round size to its class, this keeps headers aligned and pool pointers fit when freed
+	size = table_size_get(size);
+
+	//Last freed or reserved block of this class
+	struct block_free * b = (size <= TABLE_SIZE)? fast_pop(a, size) : NULL;
+	if (b != NULL)
+		return (struct block *)b;
+
+	//Search pool that could contain free block
+	b = table_search(a, size);
+
+	//Join deferred frees before growing the heap
+	if (b == NULL && __atomic_load_n(&a->fast_bytes, __ATOMIC_RELAXED) != 0)
+	{
+		lock_wait(&a->lock_heap);
+		fast_flush(a);
+		lock_signal(&a->lock_heap);
+		b = table_search(a, size);
+	}
+
+	//If block is perfect size return it.
+	if (b != NULL && size + sizeof(struct block_free) > SIZE_GET(b->size))
+		return (struct block *)b;
+
+	lock_wait(&a->lock_heap);
+
+	//If no block was found the create new one.
+	struct block * n;
+	if (b == NULL)
+	{
+		n = block_create(a, size);
+
+		//Segments from the mmap backend are split, other mappings are kept whole
+		if (n != NULL && a->kind == ARENA_HEAP && a->backend == BACKEND_MMAP && size + sizeof(struct block_free) <= SIZE_GET(n->size))
+			n = block_split(a, size, (struct block_free *)n);
+	}
+	else
+		n = block_split(a, size, b); //Split block and return.
+
+	lock_signal(&a->lock_heap);
+	return n;
+}
+
+/*
+ * @function block_carve
+ * Takes one block for count blocks of class size and cuts it into used blocks
+ * in address order. The last keeps any rest too small to split off.
+ *
+ * @param struct mem_arena * a, size_t size (class size), size_t count
+ * @return struct block * first, NULL if fail
+ */
+struct block * block_carve(struct mem_arena * a, size_t size, size_t count)
+{
+	size_t stride = size + sizeof(struct block);
+	size_t total;
+	if (count == 0 || __builtin_mul_overflow(count, stride, &total))
+		return NULL;
+
+	struct block * b = block_get(a, total - sizeof(struct block));
+	if (b == NULL)
+		return NULL;
+
+	lock_wait(&a->lock_heap);
+	struct block * n = b;
+	for (size_t i = 1; i < count; ++i)
+	{
+		struct block * r = (struct block *)((void *)n + stride);
+		r->size = 0;
+		SIZE_SET(r->size, SIZE_GET(n->size) - stride);
+		SIZE_STATE_SET(r->size, 1);
+		SIZE_ZERO_SET(r->size, SIZE_IS_ZERO(n->size));
+
+		struct block * next = LINK_GET(n->block_next);
+		LINK_SET(r->block_prev, n);
+		LINK_SET(r->block_next, next);
+		if (next != NULL)
+			LINK_SET(next->block_prev, r);
+
+		if (n == LINK_GET(a->block_last))
+			LINK_SET(a->block_last, r);
+
+		LINK_SET(n->block_next, r);
+		SIZE_SET(n->size, size);
+		n = r;
+	}
+
+	//Rest goes to a pool
+	block_split(a, size, (struct block_free *)n);
+	lock_signal(&a->lock_heap);
+	return b;
+}
+
+/*
+ * @function mem_tcache_alloc
+ * Refills a bin of the calling thread's cache with half a bin of blocks carved
+ * from one block, and returns one of them.
+ *
+ * @param unsigned int bin (MEM_TCACHE_BIN of the size asked for)
+ * @return void * address, NULL if fail
+ */
+void * mem_tcache_alloc(unsigned int bin)
+{
+	//Setup allocator if needed.
+	mem_init();
+
+	struct mem_arena * a = &arena_main;
+	size_t size = table_size_get(bin * MEM_TCACHE_STEP);
+	unsigned int count = config.cache / 2;
+	if (count < 2)
+	{
+		struct block * b = block_get(a, size);
+		return (b == NULL)? NULL : (void *)b + sizeof(struct block);
+	}
+
+	struct block * b = block_carve(a, size, count);
+	if (b == NULL)
+		return NULL;
+
+	//Rest go in the bin asked for even if the class is larger, popped in address order
+	struct block * n = b;
+	for (unsigned int i = 1; i < count; ++i)
+		n = LINK_GET(n->block_next);
+
+	for (unsigned int i = 1; i < count; ++i)
+	{
+		struct block * prev = LINK_GET(n->block_prev);
+		if (!tcache_push((struct block_free *)n, bin))
+			arena_free(a, (struct block_free *)n);
+
+		n = prev;
+	}
+
+	return (void *)b + sizeof(struct block);
+}
+
+/*
+ * @function mem_alloc
+ * Get block of memory >= size. (internal malloc)
+ *
+ * @param size_t size
+ * @return void * address
+ */
+void * mem_alloc(size_t size)
+{
+	PROBE1(alloc_entry, size);
+	if (size == 0)
+		return NULL;
+
+	table_histogram_record(size);
+
+	//Thread cache
+	void * address;
+	if (size <= MEM_TCACHE_MAX)
+	{
+		struct mem_tcache * c = &mem_tcache;
+		unsigned int i = MEM_TCACHE_BIN(size);
+		address = c->bin[i];
+		if (address == NULL)
+			address = mem_tcache_alloc(i);
+		else
+		{
+			c->bin[i] = *(void **)address;
+			c->count[i]--;
+		}
+
+		PROBE3(alloc_exit, size, address, i);
+		return address;
+	}
+
+	//Setup allocator if needed.
+	mem_init();
+
+	struct block * n = block_get(&arena_main, size);
+	address = (n == NULL)? NULL : (void *)n + sizeof(struct block);
+	PROBE3(alloc_exit, size, address, table_index_get(size));
+	return address;
+}
+
+/*
+ * @function mem_free
+ * Frees allocated memory
+ *
+ * @param void * address
+ */
+void mem_free(void * address)
+{
+	PROBE1(free_entry, address);
+	if (address == NULL)
+		return;
+
+	struct block_free * b = (struct block_free *)(address - sizeof(struct block));
+
+	if (SIZE_IS_USED(b->size) == 0)
+		return; //Error address is not a used block
+
+	//Blocks of hint and region arenas are tagged, the rest are in the main arena
+	unsigned int hint = SIZE_ARENA(b->size);
+	struct mem_arena * a = (hint != 0)? &arena_hint[hint - 1] : (SIZE_IS_REGION(b->size))? arena_find(address) : &arena_main;
+	SIZE_ARENA_SET(b->size, 0);
+	SIZE_REGION_SET(b->size, 0);
+
+	size_t size = SIZE_GET(b->size);
+	if (a == &arena_main && size <= MEM_TCACHE_MAX && !SIZE_IS_MAPPED(b->size) && tcache_push(b, size / MEM_TCACHE_STEP))
+	{
+		PROBE3(free_exit, address, size, size / MEM_TCACHE_STEP);
+		return;
+	}
+
+	//Large frees of process arenas may join or unmap, the background thread does them
+	if ((a == &arena_main || hint != 0) && async_push(a, b))
+	{
+		PROBE3(free_exit, address, size, table_index_get(size));
+		return;
+	}
+
+	arena_free(a, b);
+	PROBE3(free_exit, address, size, table_index_get(size));
+}
+
+/*
+ * @function mem_free_flush
+ * Waits until every free queued for the background thread before the call is done.
+ */
+void mem_free_flush(void)
+{
+	size_t target = __atomic_load_n(&async_queued, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&async_done, __ATOMIC_SEQ_CST) >= target)
+		return;
+
+	pthread_mutex_lock(&async_mutex);
+	while (__atomic_load_n(&async_done, __ATOMIC_ACQUIRE) < target)
+		pthread_cond_wait(&async_flushed, &async_mutex);
+	pthread_mutex_unlock(&async_mutex);
+}
+
+/*
+ * @function memory_zero
+ * Sets memory to 0. Large ranges use non-temporal stores so clearing does not
+ * evict the cache.
+ *
+ * @param void * address, size_t size
+ */
+void memory_zero(void * address, size_t size)
+{
+	#ifdef __SSE2__
+		if (size >= ZERO_STREAM_MIN)
+		{
+			//Align head to 16 bytes
+			size_t head = (16 - ((size_t)address & 15)) & 15;
+			memset(address, 0, head);
+			address += head;
+			size -= head;
+
+			__m128i zero = _mm_setzero_si128();
+			__m128i * p = (__m128i *)address;
+			for (size_t i = size / 64; i > 0; --i, p += 4)
+			{
+				_mm_stream_si128(p, zero);
+				_mm_stream_si128(p + 1, zero);
+				_mm_stream_si128(p + 2, zero);
+				_mm_stream_si128(p + 3, zero);
+			}
+			_mm_sfence();
+
+			memset((void *)p, 0, size & 63);
+			return;
+		}
+	#endif //__SSE2__
+
+	memset(address, 0, size);
+}
+
+/*
+ * @function block_zero
+ * Sets the first size bytes of a used block to 0. Blocks known to be zero only
+ * hold pool pointers at the start of the payload.
+ *
+ * @param struct block * b, size_t size
+ * @return void * address of payload
+ */
+void * block_zero(struct block * b, size_t size)
+{
+	void * address = (void *)b + sizeof(struct block);
+
+	if (SIZE_IS_ZERO(b->size))
+		memset(address, 0, (size < BLOCK_SIZE_MIN)? size : BLOCK_SIZE_MIN);
+	else
+		memory_zero(address, size);
+
+	SIZE_ZERO_SET(b->size, 0);
+	return address;
+}
+
+/*
+ * @function mem_calloc
+ * Allocates memory array set to 0. Blocks known to be zero are not cleared and
+ * large arrays are taken from fresh pages.
+ *
+ * @param size_t number of nodes, size_t sizeof node
+ */
+void * mem_calloc(size_t n, size_t size)
+{
+	size_t total;
+	if (__builtin_mul_overflow(n, size, &total) || total == 0)
+		return NULL;
+
+	//Larger sizes would spill into the flag bits, or wrap when aligned
+	if (total > SIZE_MASK / 2)
+		return NULL;
+
+	//Setup allocator if needed.
+	mem_init();
+	table_histogram_record(total);
+
+	struct mem_arena * a = &arena_main;
+	struct block * b;
+	if (total >= CALLOC_FRESH_MIN)
+	{
+		lock_wait(&a->lock_heap);
+		b = block_create(a, SIZE_ALIGN(total));
+		lock_signal(&a->lock_heap);
+	}
+	else
+		b = block_get(a, total);
+
+	return (b == NULL)? NULL : block_zero(b, total);
+}
+
+/*
+ * @function mem_alloc_flags
+ * Gets block of memory >= size from the arena for a lifetime hint, set to 0 if
+ * MEM_ZEROED. Hints beyond config.arenas are served by the main arena.
+ *
+ * @param size_t size, unsigned int flags (MEM_SHORT_LIVED, MEM_LONG_LIVED, MEM_HOT, MEM_ZEROED)
+ * @return void * address, NULL if fail
+ */
+void * mem_alloc_flags(size_t size, unsigned int flags)
+{
+	if (size == 0)
+		return NULL;
+
+	//Setup allocator if needed.
+	mem_init();
+
+	unsigned int hint = 0;
+	for (unsigned int i = 0; i < ARENA_HINTS && hint == 0; ++i)
+		if ((flags & (1U << i)) != 0 && i + 1 < config.arenas)
+			hint = i + 1;
+
+	if (hint == 0)
+		return ((flags & MEM_ZEROED) != 0)? mem_calloc(1, size) : mem_alloc(size);
+
+	table_histogram_record(size);
+	struct block * b = block_get(&arena_hint[hint - 1], size);
+	if (b == NULL)
+		return NULL;
+
+	void * address = ((flags & MEM_ZEROED) != 0)? block_zero(b, size) : (void *)b + sizeof(struct block);
+	SIZE_ARENA_SET(b->size, hint);
+	return address;
+}
+
+/*
+ * @function mem_realloc
+ * Reallocates memory into new block of size. Blocks that still fit are kept and
+ * blocks followed by enough free space grow in place.
+ *
+ * @param void * adrdess, size_t new size
+ */
+void * mem_realloc(void * address, size_t size)
+{
+	if (address == NULL)
+		return NULL;
+
+	//Kept if it still fits and does not waste half the block
+	struct block * b = (struct block *)(address - sizeof(struct block));
+	size_t old = SIZE_GET(b->size);
+	if (size != 0 && size <= old && size >= old / 2)
+		return address;
+
+	//New block comes from the same arena
+	unsigned int hint = SIZE_ARENA(b->size);
+	struct mem_arena * a = (hint != 0)? &arena_hint[hint - 1] : (SIZE_IS_REGION(b->size))? arena_find(address) : &arena_main;
+
+	//Grow into a free right neighbour, the rest of it is split off again
+	if (size > old && size <= SIZE_MASK / 2)
+	{
+		size_t want = table_size_get(size);
+		lock_wait(&a->lock_heap);
+
+		struct block_free * r = LINK_GET(b->block_next);
+		if (r != NULL && !SIZE_IS_USED(r->size) && old + sizeof(struct block) + SIZE_GET(r->size) >= want && pool_claim(a, r))
+		{
+			SIZE_SET(b->size, old + sizeof(struct block) + SIZE_GET(r->size));
+			SIZE_ZERO_SET(b->size, 0);
+
+			struct block * next = LINK_GET(r->block_next);
+			LINK_SET(b->block_next, next);
+			if (next != NULL)
+				LINK_SET(next->block_prev, b);
+
+			if ((struct block *)r == LINK_GET(a->block_last))
+				LINK_SET(a->block_last, b);
+
+			block_split(a, want, (struct block_free *)b);
+			lock_signal(&a->lock_heap);
+			return address;
+		}
+
+		lock_signal(&a->lock_heap);
+	}
+
+	void * temp;
+	if (hint != 0)
+		temp = mem_alloc_flags(size, 1U << (hint - 1));
+	else
+		temp = (a == &arena_main)? mem_alloc(size) : mem_arena_alloc(a, size);
+	if (temp == NULL)
+		return NULL;
+
+	memcpy(temp, (const void *)address, (size < old)? size : old);
+	mem_free(address);
+	return temp;
+}
+
+/*
+ * @function mem_usable_size
+ * Bytes a block from mem_alloc, mem_calloc, mem_realloc or mem_alloc_flags can
+ * hold, at least the size asked for.
+ *
+ * @param void * address
+ * @return size_t bytes, 0 for NULL
+ */
+size_t mem_usable_size(void * address)
+{
+	if (address == NULL)
+		return 0;
+
+	return SIZE_GET(((struct block *)(address - sizeof(struct block)))->size);
+}
+
+/*
+ * @function mem_alloc_at_least
+ * Gets block of memory >= size and tells how many bytes it can hold.
+ *
+ * @param size_t size, size_t * actual (out, 0 if fail, may be NULL)
+ * @return void * address, NULL if fail
+ */
+void * mem_alloc_at_least(size_t size, size_t * actual)
+{
+	void * address = mem_alloc(size);
+	if (actual != NULL)
+		*actual = mem_usable_size(address);
+
+	return address;
+}
+
+/*
+ * @function mem_classes_build
+ * Derives size classes from the allocation histogram. Uses the fewest classes
+ * where no class wastes more than the target fraction of the bytes it hands out.
+ *
+ * @param double waste (0.0 - 1.0, < 0 for CLASS_WASTE_DEFAULT), unsigned int * bounds (out), unsigned int max bounds
+ * @return unsigned int number of classes, bounds only written if <= max
+ */
+unsigned int mem_classes_build(double waste, unsigned int * bounds, unsigned int max)
+{
+	if (waste < 0)
+		waste = CLASS_WASTE_DEFAULT;
+
+	//Sizes below BLOCK_SIZE_MIN are rounded up to it
+	double seen[CLASS_MAX + 1] = {0};
+	for (unsigned int i = 1; i <= CLASS_MAX; ++i)
+		seen[(i * CLASS_STEP < BLOCK_SIZE_MIN)? BLOCK_SIZE_MIN / CLASS_STEP : i] += (double)table_histogram[i];
+
+	//Prefix sums of counts and requested bytes per step
+	double count[CLASS_MAX + 1];
+	double bytes[CLASS_MAX + 1];
+	count[0] = 0;
+	bytes[0] = 0;
+
+	for (unsigned int i = 1; i <= CLASS_MAX; ++i)
+	{
+		count[i] = count[i - 1] + seen[i];
+		bytes[i] = bytes[i - 1] + seen[i] * (double)(i * CLASS_STEP);
+	}
+
+	//Fewest classes ending at step j, ties broken by least waste
+	unsigned short classes[CLASS_MAX + 1];
+	unsigned short from[CLASS_MAX + 1];
+	double lost[CLASS_MAX + 1];
+	classes[0] = 0;
+	lost[0] = 0;
+
+	for (unsigned int j = 1; j <= CLASS_MAX; ++j)
+	{
+		classes[j] = USHRT_MAX;
+		for (unsigned int i = 0; i < j; ++i)
+		{
+			double used = (count[j] - count[i]) * (double)(j * CLASS_STEP);
+			double w = used - (bytes[j] - bytes[i]);
+			if (w > waste * used)
+				continue;
+
+			if (classes[i] + 1 < classes[j] || (classes[i] + 1 == classes[j] && lost[i] + w < lost[j]))
+			{
+				classes[j] = (unsigned short)(classes[i] + 1);
+				lost[j] = lost[i] + w;
+				from[j] = (unsigned short)i;
+			}
+		}
+	}
+
+	unsigned int n = classes[CLASS_MAX];
+	if (bounds == NULL || n > max)
+		return n;
+
+	unsigned int c = n;
+	for (unsigned int j = CLASS_MAX; j > 0; j = from[j])
+		bounds[--c] = j * CLASS_STEP;
+
+	return n;
+}
+
+/*
+ * @function mem_classes_apply
+ * Sets size classes and moves free blocks to their new pools. No other thread
+ * may use the allocator during the call.
+ *
+ * @param const unsigned int * bounds (ascending multiples of CLASS_STEP, last is TABLE_SIZE), unsigned int count
+ * @return int 0 success, -1 invalid classes or a shared arena is mapped
+ */
+int mem_classes_apply(const unsigned int * bounds, unsigned int count)
+{
+	mem_init();
+	return table_class_apply(bounds, count);
+}
+
+/*
+ * @function mem_histogram_reset
+ * Clears the allocation histogram.
+ */
+void mem_histogram_reset(void)
+{
+	memset(table_histogram, 0, sizeof(table_histogram));
+}
+
+/*
+ * @function mem_profile_save
+ * Derives size classes from the histogram and writes them to a file, one class
+ * size per line.
+ *
+ * @param const char * path, double waste
+ * @return int 0 success, -1 fail
+ */
+int mem_profile_save(const char * path, double waste)
+{
+	unsigned int bounds[CLASS_MAX];
+	unsigned int count = mem_classes_build(waste, bounds, CLASS_MAX);
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return -1;
+
+	//Written without stdio so the allocator is not re-entered
+	char text[CLASS_MAX * 8];
+	size_t length = 0;
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		length += text_number(text + length, bounds[i]);
+		text[length++] = '\n';
+	}
+
+	ssize_t written = write(fd, text, length);
+	close(fd);
+	return (written == (ssize_t)length)? 0 : -1;
+}
+
+/*
+ * @function mem_profile_load
+ * Reads size classes saved by mem_profile_save and applies them. Same rules as
+ * mem_classes_apply.
+ *
+ * @param const char * path
+ * @return int 0 success, -1 fail
+ */
+int mem_profile_load(const char * path)
+{
+	mem_init();
+
+	unsigned int bounds[CLASS_MAX];
+	int count = table_profile_read(path, bounds);
+	if (count == -1)
+		return -1;
+
+	return table_class_apply(bounds, (unsigned int)count);
+}
+
+/*
+ * @function lock_stats_add
+ * Adds lock counters of arena.
+ *
+ * @param struct mem_lock_stats * stats, struct mem_arena * a
+ */
+void lock_stats_add(struct mem_lock_stats * stats, struct mem_arena * a)
+{
+	stats->acquires += a->lock_heap.acquires;
+	stats->contended += a->lock_heap.contended;
+	stats->sleeps += a->lock_heap.sleeps;
+
+	for (unsigned int i = 0; i <= CLASS_MAX; ++i)
+	{
+		stats->acquires += a->table[i].lock.acquires;
+		stats->contended += a->table[i].lock.contended;
+		stats->sleeps += a->table[i].lock.sleeps;
+	}
+}
+
+/*
+ * @function mem_lock_stats_get
+ * Sums lock counters. Counters are read without taking the locks.
+ *
+ * @param struct mem_lock_stats * stats
+ */
+void mem_lock_stats_get(struct mem_lock_stats * stats)
+{
+	memset(stats, 0, sizeof(struct mem_lock_stats));
+
+	for (struct arena_map * m = &arena_maps; m != NULL; m = arena_map_next(m))
+		lock_stats_add(stats, m->arena);
+
+	for (unsigned int i = 0; i < ARENA_HINTS && i + 1 < config.arenas; ++i)
+		lock_stats_add(stats, &arena_hint[i]);
+}
+
+/*
+ * @function heap_walk_arena
+ * Calls callback for every block of arena. Deferred frees are joined first.
+ *
+ * @param struct mem_arena * a, void (*callback)(const struct mem_span *, void *), void * data, struct mem_span * span
+ * @return size_t number of spans
+ */
+size_t heap_walk_arena(struct mem_arena * a, void (*callback)(const struct mem_span *, void *), void * data, struct mem_span * span)
+{
+	size_t count = 0;
+
+	lock_wait(&a->lock_heap);
+	fast_flush(a);
+
+	for (struct segment * s = LINK_GET(a->segment_list); s != NULL; s = LINK_GET(s->next), span->segment++)
+	{
+		struct block * b = (struct block *)(s + 1);
+		span->mapped = SIZE_IS_MAPPED(b->size);
+
+		for (; b != NULL; b = LINK_GET(b->block_next), count++)
+		{
+			span->address = (void *)b + sizeof(struct block);
+			span->size = SIZE_GET(b->size);
+			span->used = SIZE_IS_USED(b->size);
+			callback(span, data);
+		}
+	}
+
+	lock_signal(&a->lock_heap);
+	return count;
+}
+
+/*
+ * @function mem_heap_walk
+ * Calls callback for every block of every mapping and heap run of every
+ * arena, main first then hint arenas and regions, in address order within each.
+ * Deferred frees are joined first so free spans are whole.
+ * The heap is locked during the walk, callback must not allocate or free.
+ *
+ * @param void (*callback)(const struct mem_span *, void *), void * data (passed to callback)
+ * @return size_t number of spans
+ */
+size_t mem_heap_walk(void (*callback)(const struct mem_span *, void *), void * data)
+{
+	mem_init();
+
+	//Blocks in the calling thread's cache are shown free
+	for (unsigned int i = 0; i < MEM_TCACHE_BINS; ++i)
+		tcache_flush(i, 0);
+
+	struct mem_span span;
+	span.segment = 0;
+	size_t count = heap_walk_arena(&arena_main, callback, data, &span);
+
+	for (unsigned int i = 0; i < ARENA_HINTS && i + 1 < config.arenas; ++i)
+		count += heap_walk_arena(&arena_hint[i], callback, data, &span);
+
+	for (struct arena_map * m = arena_map_next(&arena_maps); m != NULL; m = arena_map_next(m))
+		count += heap_walk_arena(m->arena, callback, data, &span);
+
+	return count;
+}
+
+/*
+ * @function heap_stats_add
+ * mem_heap_walk callback that adds span to struct mem_heap_stats.
+ *
+ * @param const struct mem_span * span, void * data (struct mem_heap_stats *)
+ */
+void heap_stats_add(const struct mem_span * span, void * data)
+{
+	struct mem_heap_stats * stats = (struct mem_heap_stats *)data;
+
+	if (span->segment >= stats->segments)
+	{
+		stats->segments = span->segment + 1;
+		stats->heap_bytes += sizeof(struct segment);
+	}
+
+	stats->heap_bytes += sizeof(struct block) + span->size;
+
+	if (span->used)
+	{
+		stats->used_blocks++;
+		stats->used_bytes += span->size;
+		return;
+	}
+
+	stats->free_blocks++;
+	stats->free_bytes += span->size;
+	if (span->size > stats->free_largest)
+		stats->free_largest = span->size;
+
+	unsigned int i = (unsigned int)(sizeof(unsigned long long) * 8 - 1) - (unsigned int)__builtin_clzll(span->size);
+	stats->free_histogram[(i < MEM_HEAP_HISTOGRAM)? i : MEM_HEAP_HISTOGRAM - 1]++;
+}
+
+/*
+ * @function heap_stats_finish
+ * Derives ratios once every span is added.
+ *
+ * @param struct mem_heap_stats * stats
+ */
+void heap_stats_finish(struct mem_heap_stats * stats)
+{
+	stats->fragmentation = (stats->free_bytes == 0)? 0 : 1.0 - (double)stats->free_largest / (double)stats->free_bytes;
+}
+
+/*
+ * @function mem_heap_stats_get
+ * Snapshot of heap use and free space fragmentation.
+ *
+ * @param struct mem_heap_stats * stats
+ */
+void mem_heap_stats_get(struct mem_heap_stats * stats)
+{
+	memset(stats, 0, sizeof(struct mem_heap_stats));
+	mem_heap_walk(heap_stats_add, stats);
+	heap_stats_finish(stats);
+}
+
+//State of mem_heap_dump, text is written without stdio
+struct heap_dump
+{
+	struct mem_heap_stats stats;
+	int fd;
+	int error;
+	size_t length;
+	char text[4096];
+};
+
+/*
+ * @function heap_dump_flush
+ * Writes buffered dump text.
+ *
+ * @param struct heap_dump * dump
+ */
+void heap_dump_flush(struct heap_dump * dump)
+{
+	if (dump->length != 0 && write(dump->fd, dump->text, dump->length) != (ssize_t)dump->length)
+		dump->error = 1;
+
+	dump->length = 0;
+}
+
+/*
+ * @function heap_dump_line
+ * Adds "name value" line to dump.
+ *
+ * @param struct heap_dump * dump, const char * name, size_t value
+ */
+void heap_dump_line(struct heap_dump * dump, const char * name, size_t value)
+{
+	if (dump->length + 64 + 20 > sizeof(dump->text))
+		heap_dump_flush(dump);
+
+	for (size_t i = 0; name[i] != '\0' && i < 64; ++i)
+		dump->text[dump->length++] = name[i];
+
+	dump->text[dump->length++] = ' ';
+	dump->length += text_number(dump->text + dump->length, value);
+	dump->text[dump->length++] = '\n';
+}
+
+/*
+ * @function heap_dump_span
+ * mem_heap_walk callback that writes "span segment address size used|free
+ * heap|mapped" and adds the span to the dump stats.
+ *
+ * @param const struct mem_span * span, void * data (struct heap_dump *)
+ */
+void heap_dump_span(const struct mem_span * span, void * data)
+{
+	struct heap_dump * dump = (struct heap_dump *)data;
+	heap_stats_add(span, &dump->stats);
+
+	if (dump->length + 80 > sizeof(dump->text))
+		heap_dump_flush(dump);
+
+	char * text = dump->text + dump->length;
+	size_t n = 0;
+
+	memcpy(text, "span ", 5);
+	n += 5;
+	n += text_number(text + n, span->segment);
+	text[n++] = ' ';
+	n += text_hex(text + n, (size_t)span->address);
+	text[n++] = ' ';
+	n += text_number(text + n, span->size);
+	memcpy(text + n, (span->used)? " used" : " free", 5);
+	n += 5;
+	memcpy(text + n, (span->mapped)? " mapped\n" : " heap\n", (span->mapped)? 8 : 6);
+	n += (span->mapped)? 8 : 6;
+
+	dump->length += n;
+}
+
+/*
+ * @function mem_heap_dump
+ * Writes every span and the fragmentation stats to fd as text, one record per
+ * line: "span segment address size used|free heap|mapped", then "name value"
+ * totals, "fragmentation_ppm value" (ratio * 1000000) and
+ * "free_histogram bucket count" where the bucket holds sizes 2^bucket to
+ * 2^(bucket + 1) - 1.
+ *
+ * @param int fd
+ * @return int 0 success, -1 fail
+ */
+int mem_heap_dump(int fd)
+{
+	//Too large for some thread stacks
+	static struct heap_dump dump;
+	static lock_t lock_dump = LOCK_INITIALIZER;
+
+	lock_wait(&lock_dump);
+	memset(&dump.stats, 0, sizeof(struct mem_heap_stats));
+	dump.fd = fd;
+	dump.error = 0;
+	dump.length = 0;
+
+	mem_heap_walk(heap_dump_span, &dump);
+	heap_stats_finish(&dump.stats);
+
+	heap_dump_line(&dump, "segments", dump.stats.segments);
+	heap_dump_line(&dump, "heap_bytes", dump.stats.heap_bytes);
+	heap_dump_line(&dump, "used_blocks", dump.stats.used_blocks);
+	heap_dump_line(&dump, "used_bytes", dump.stats.used_bytes);
+	heap_dump_line(&dump, "free_blocks", dump.stats.free_blocks);
+	heap_dump_line(&dump, "free_bytes", dump.stats.free_bytes);
+	heap_dump_line(&dump, "free_largest", dump.stats.free_largest);
+	heap_dump_line(&dump, "fragmentation_ppm", (size_t)(dump.stats.fragmentation * 1000000.0 + 0.5));
+
+	for (unsigned int i = 0; i < MEM_HEAP_HISTOGRAM; ++i)
+	{
+		if (dump.stats.free_histogram[i] == 0)
+			continue;
+
+		if (dump.length + 64 > sizeof(dump.text))
+			heap_dump_flush(&dump);
+
+		memcpy(dump.text + dump.length, "free_histogram ", 15);
+		dump.length += 15;
+		dump.length += text_number(dump.text + dump.length, i);
+		dump.text[dump.length++] = ' ';
+		dump.length += text_number(dump.text + dump.length, dump.stats.free_histogram[i]);
+		dump.text[dump.length++] = '\n';
+	}
+
+	heap_dump_flush(&dump);
+	int error = dump.error;
+	lock_signal(&lock_dump);
+
+	return (error)? -1 : 0;
+}
+
+/*
+ * @function mem_reserve
+ * Grows the heap so at least bytes are free at its top, faults them in and
+ * keeps them as headroom so trimming does not give them back. Reserved memory
+ * is on the sbrk heap whatever the backend.
+ *
+ * @param size_t bytes, unsigned int flags (MEM_RESERVE_LOCK to lock the pages)
+ * @return int 0 success, -1 fail
+ */
+int mem_reserve(size_t bytes, unsigned int flags)
+{
+	mem_init();
+
+	struct mem_arena * a = &arena_main;
+	bytes = SIZE_ALIGN(bytes);
+	int result = 0;
+
+	lock_wait(&a->lock_heap);
+	if (bytes > a->headroom)
+		a->headroom = bytes;
+
+	//Free top of the heap counts, the new block is joined to it
+	struct block * last = LINK_GET(a->block_last);
+	size_t top = (last != NULL && !SIZE_IS_USED(last->size))? SIZE_GET(last->size) + sizeof(struct block) : 0;
+	if (top < bytes + sizeof(struct block))
+	{
+		size_t need = bytes + sizeof(struct block) - top;
+		struct block * n = block_grow(a, (need < BLOCK_SIZE_MIN)? BLOCK_SIZE_MIN : need);
+		if (n != NULL)
+			block_put(a, (struct block_free *)n);
+		else
+			result = -1;
+	}
+
+	//Taken out of its pool while it is faulted in
+	struct block_free * b = LINK_GET(a->block_last);
+	if (b != NULL && !SIZE_IS_USED(b->size) && pool_claim(a, b))
+	{
+		if (page_populate((void *)b + sizeof(struct block), SIZE_GET(b->size), (flags & MEM_RESERVE_LOCK) != 0) != 0)
+			result = -1;
+
+		SIZE_STATE_SET(b->size, 0);
+		pool_insert(a, b);
+	}
+
+	lock_signal(&a->lock_heap);
+	return result;
+}
+
+/*
+ * @function mem_reserve_class
+ * Cuts count blocks of the class of size and puts them on its fast list, so
+ * they are handed out without a split or a page fault. They stay until fast
+ * lists are next joined (an allocation misses every pool or fast_limit bytes
+ * are waiting).
+ *
+ * @param size_t size (<= TABLE_SIZE), size_t count, unsigned int flags (MEM_RESERVE_LOCK to lock the pages)
+ * @return int 0 success, -1 fail
+ */
+int mem_reserve_class(size_t size, size_t count, unsigned int flags)
+{
+	mem_init();
+
+	struct mem_arena * a = &arena_main;
+	size = table_size_get(size);
+	size_t total;
+	if (size > TABLE_SIZE || count == 0 || __builtin_mul_overflow(count, size + sizeof(struct block), &total))
+		return -1;
+
+	struct block * b = block_carve(a, size, count);
 	if (b == NULL)
 		return -1;
 
-	struct pool * p = &table[table_index_get(SIZE_GET(b->size))];
-	if (b == p->start)
-		p->start = b->pool_next;
+	int result = page_populate((void *)b + sizeof(struct block), total - sizeof(struct block), (flags & MEM_RESERVE_LOCK) != 0);
+
+	//Last pushed is handed out first, so blocks go out in address order
+	struct block * n = b;
+	for (size_t i = 1; i < count; ++i)
+		n = LINK_GET(n->block_next);
+
+	struct pool * p = &a->table[fast_index(size)];
+	for (size_t i = 0; i < count; ++i)
+	{
+		struct block * prev = (i + 1 < count)? LINK_GET(n->block_prev) : NULL;
+
+		lock_wait(&p->lock);
+		struct block_free * next = LINK_GET(p->fast);
+		LINK_SET(((struct block_free *)n)->pool_next, next);
+		LINK_SET(p->fast, n);
+		p->fast_size++;
+		lock_signal(&p->lock);
+
+		__atomic_add_fetch(&a->fast_bytes, SIZE_GET(n->size) + sizeof(struct block), __ATOMIC_RELAXED);
+		n = prev;
+	}
+
+	return result;
+}
+
+/*
+ * @function arena_rebuild
+ * Fills the pools of a region from its block chain. Used when the region was
+ * not closed, or its pools were filled with other size classes. Free
+ * neighbours a crash left apart are joined.
+ *
+ * @param struct mem_arena * a
+ */
+void arena_rebuild(struct mem_arena * a)
+{
+	arena_setup(a);
+
+	for (struct segment * s = LINK_GET(a->segment_list); s != NULL; s = LINK_GET(s->next))
+		for (struct block * b = (struct block *)(s + 1); b != NULL; b = LINK_GET(b->block_next))
+		{
+			if (SIZE_IS_USED(b->size))
+				continue;
+
+			struct block * n;
+			while ((n = LINK_GET(b->block_next)) != NULL && !SIZE_IS_USED(n->size))
+			{
+				SIZE_SET(b->size, SIZE_GET(b->size) + sizeof(struct block) + SIZE_GET(n->size));
+				SIZE_ZERO_SET(b->size, 0);
+
+				struct block * next = LINK_GET(n->block_next);
+				LINK_SET(b->block_next, next);
+				if (next != NULL)
+					LINK_SET(next->block_prev, b);
+
+				if (n == LINK_GET(a->block_last))
+					LINK_SET(a->block_last, b);
+			}
+
+			pool_insert(a, (struct block_free *)b);
+		}
+}
+
+/*
+ * @function mem_arena_alloc
+ * Get block of memory >= size from arena.
+ *
+ * @param struct mem_arena * a, size_t size
+ * @return void * address
+ */
+void * mem_arena_alloc(struct mem_arena * a, size_t size)
+{
+	if (a == NULL || size == 0)
+		return NULL;
+
+	mem_init();
+
+	struct block * n = block_get(a, size);
+	if (n == NULL)
+		return NULL;
+
+	//Inline frees leave tagged blocks to mem_free
+	SIZE_REGION_SET(n->size, 1);
+	return (void *)n + sizeof(struct block);
+}
+
+/*
+ * @function mem_persist_open
+ * Maps a persistent arena from file. A new file gets a region of size bytes at
+ * address (0 for the defaults), an existing one is mapped where it was made so
+ * pointers stored in it stay valid. A region that was not closed has its pools
+ * rebuilt. Fails if the address is taken.
+ *
+ * @param const char * path, void * address, size_t size
+ * @return struct mem_arena *, NULL on fail
+ */
+struct mem_arena * mem_persist_open(const char * path, void * address, size_t size)
+{
+	mem_init();
+
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd == -1)
+		return NULL;
+
+	struct stat st;
+	struct mem_arena * a = NULL;
+	if (fstat(fd, &st) == -1)
+		goto fail;
+
+	//Existing region is found from its header
+	bool warm = (st.st_size != 0);
+	if (warm)
+	{
+		__typeof__(a->header) header;
+		if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) || header.magic != ARENA_MAGIC ||
+		    header.version != ARENA_VERSION || header.size != (size_t)st.st_size)
+			goto fail;
+
+		address = (void *)header.base;
+		size = header.size;
+	}
+	else
+	{
+		size_t page = page_size_get();
+		address = (address != NULL)? address : (void *)PERSIST_ADDRESS;
+		size = ((size != 0)? size : PERSIST_SIZE) & ~(page - 1);
+		if (((size_t)address & (page - 1)) != 0 || size < sizeof(struct mem_arena) + page || ftruncate(fd, (off_t)size) == -1)
+			goto fail;
+	}
+
+	a = (struct mem_arena *)page_map_file(fd, address, size);
+	if (a == NULL)
+		goto fail;
+
+	if (warm && a->kind != ARENA_REGION)
+	{
+		page_unmap((void *)a, size);
+		goto fail;
+	}
+
+	if (!warm)
+		arena_region_setup(a, ARENA_REGION, size);
+	else if (!a->header.clean || a->header.classes != table_class_signature())
+		arena_rebuild(a);
+	else
+		arena_locks_create(a);
+
+	//A crash from here on leaves the region dirty
+	a->header.clean = 0;
+	msync((void *)a, page_size_get(), MS_SYNC);
+
+	if (arena_map_add(a, size, fd) == 0)
+		return a;
+
+	page_unmap((void *)a, size);
+
+	fail:
+	close(fd);
+	return NULL;
+}
+
+/*
+ * @function mem_persist_close
+ * Writes the region back to its file, marks it clean and unmaps it. No other
+ * thread may use the arena or its memory during or after the call.
+ *
+ * @param struct mem_arena * a
+ * @return int 0 success, -1 fail (region is left dirty)
+ */
+int mem_persist_close(struct mem_arena * a)
+{
+	int fd = arena_map_remove(a);
+	if (fd == -1)
+		return -1;
+
+	//Data first, then the flag that says it can be trusted
+	lock_wait(&a->lock_heap);
+	int result = msync((void *)a, a->region_high, MS_SYNC);
+	if (result == 0)
+	{
+		a->header.clean = 1;
+		result = msync((void *)a, page_size_get(), MS_SYNC);
+	}
+	lock_signal(&a->lock_heap);
+
+	result |= page_unmap((void *)a, a->header.size);
+	close(fd);
+	return (result == 0)? 0 : -1;
+}
+
+/*
+ * @function mem_persist_root_set
+ * Stores the object a restarted process starts from.
+ *
+ * @param struct mem_arena * a, void * root
+ */
+void mem_persist_root_set(struct mem_arena * a, void * root)
+{
+	a->header.root = root;
+}
+
+/*
+ * @function mem_persist_root_get
+ * Returns the object stored with mem_persist_root_set.
+ *
+ * @param struct mem_arena * a
+ * @return void * root
+ */
+void * mem_persist_root_get(struct mem_arena * a)
+{
+	return a->header.root;
+}
+
+/*
+ * @function arena_shared_map
+ * Maps the shared arena in fd once its creator has set it up.
+ *
+ * @param int fd
+ * @return struct mem_arena *, NULL on fail (fd is closed)
+ */
+struct mem_arena * arena_shared_map(int fd)
+{
+	struct stat st;
+	struct mem_arena * a = NULL;
+
+	//Creator sizes the memory, then sets the magic last
+	for (unsigned int ms = 0; ms <= SHARED_WAIT; ++ms)
+	{
+		if (a == NULL && fstat(fd, &st) == 0 && (size_t)st.st_size > sizeof(struct mem_arena))
+			a = (struct mem_arena *)page_map_file(fd, NULL, (size_t)st.st_size);
+
+		if (a != NULL && __atomic_load_n(&a->header.magic, __ATOMIC_ACQUIRE) == ARENA_MAGIC)
+			break;
+
+		struct timespec t = {0, 1000000};
+		nanosleep(&t, NULL);
+	}
+
+	if (a == NULL)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	//Blocks are binned by size class, every process must use the same ones
+	if (a->header.magic != ARENA_MAGIC || a->header.version != ARENA_VERSION || a->kind != ARENA_SHARED ||
+	    a->header.size != (size_t)st.st_size || a->header.classes != table_class_signature() || arena_map_add(a, a->header.size, fd) == -1)
+	{
+		page_unmap((void *)a, (size_t)st.st_size);
+		close(fd);
+		return NULL;
+	}
+
+	return a;
+}
+
+/*
+ * @function mem_shared_open
+ * Creates or attaches a shared arena. Named arenas use shm_open, the first
+ * process creates the memory and later ones attach; remove it with shm_unlink.
+ * Without a name a memfd is used, shared with children by fork or by passing
+ * mem_shared_fd to mem_shared_attach in another process.
+ *
+ * @param const char * name (NULL for memfd), size_t size (0 for SHARED_SIZE)
+ * @return struct mem_arena *, NULL on fail
+ */
+struct mem_arena * mem_shared_open(const char * name, size_t size)
+{
+	mem_init();
+
+	int fd = -1;
+	if (name != NULL)
+	{
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd == -1 && errno == EEXIST)
+		{
+			fd = shm_open(name, O_RDWR, 0600);
+			return (fd == -1)? NULL : arena_shared_map(fd);
+		}
+	}
+	#if defined(__linux) && defined(SYS_memfd_create)
+		else //Not closed on exec, workers started with exec can attach to it
+			fd = (int)syscall(SYS_memfd_create, "gpmalloc", 0);
+	#endif
+
+	if (fd == -1)
+		return NULL;
+
+	size_t page = page_size_get();
+	size = ((size != 0)? size : SHARED_SIZE) & ~(page - 1);
+
+	struct mem_arena * a = NULL;
+	if (size >= sizeof(struct mem_arena) + page && ftruncate(fd, (off_t)size) == 0)
+		a = (struct mem_arena *)page_map_file(fd, NULL, size);
+
+	if (a != NULL)
+	{
+		arena_region_setup(a, ARENA_SHARED, size);
+		if (arena_map_add(a, size, fd) == 0)
+			return a;
+
+		page_unmap((void *)a, size);
+	}
+
+	//Processes waiting on it give up once SHARED_WAIT has passed
+	if (name != NULL)
+		shm_unlink(name);
+
+	close(fd);
+	return NULL;
+}
+
+/*
+ * @function mem_shared_attach
+ * Attaches the shared arena in fd, e.g. a memfd passed from another process.
+ * The arena keeps fd and closes it with mem_shared_close.
+ *
+ * @param int fd
+ * @return struct mem_arena *, NULL on fail
+ */
+struct mem_arena * mem_shared_attach(int fd)
+{
+	mem_init();
+
+	if (fd == -1)
+		return NULL;
+
+	return arena_shared_map(fd);
+}
+
+/*
+ * @function mem_shared_close
+ * Unmaps a shared arena from this process. Its memory stays for the others.
+ * No other thread may use the arena or its memory during or after the call.
+ *
+ * @param struct mem_arena * a
+ * @return int 0 success, -1 fail
+ */
+int mem_shared_close(struct mem_arena * a)
+{
+	int fd = arena_map_remove(a);
+	if (fd == -1)
+		return -1;
+
+	int result = page_unmap((void *)a, a->header.size);
+	close(fd);
+	return result;
+}
+
+/*
+ * @function mem_shared_fd
+ * Returns the file descriptor holding a region arena.
+ *
+ * @param struct mem_arena * a
+ * @return int fd, -1 if not mapped
+ */
+int mem_shared_fd(struct mem_arena * a)
+{
+	for (struct arena_map * m = arena_map_next(&arena_maps); m != NULL; m = arena_map_next(m))
+		if (m->arena == a)
+			return m->fd;
+
+	return -1;
+}
+
+/*
+ * @function mem_shared_offset
+ * Turns address in a shared arena into an offset other processes can use.
+ *
+ * @param struct mem_arena * a, void * address
+ * @return size_t offset, 0 for NULL
+ */
+size_t mem_shared_offset(struct mem_arena * a, void * address)
+{
+	return (address == NULL)? 0 : (size_t)(address - (void *)a);
+}
+
+/*
+ * @function mem_shared_pointer
+ * Turns offset from mem_shared_offset into an address in this process.
+ *
+ * @param struct mem_arena * a, size_t offset
+ * @return void * address, NULL for 0
+ */
+void * mem_shared_pointer(struct mem_arena * a, size_t offset)
+{
+	return (offset == 0)? NULL : (void *)a + offset;
+}
+
+/*
+ * @function mem_compressed_open
+ * Reserves a compressed arena of size bytes. Pages are faulted in as the arena
+ * grows and given back when its top is freed. The arena is private, a child
+ * after fork has a copy.
+ *
+ * @param size_t size (0 for COMPRESSED_SIZE, at most 4G << MEM_COMPRESSED_SHIFT)
+ * @return struct mem_arena *, NULL on fail
+ */
+struct mem_arena * mem_compressed_open(size_t size)
+{
+	mem_init();
+
+	size_t page = page_size_get();
+	size = ((size != 0)? size : COMPRESSED_SIZE) & ~(page - 1);
+	if (size < sizeof(struct mem_arena) + page || size > ((size_t)1 << (32 + MEM_COMPRESSED_SHIFT)))
+		return NULL;
+
+	struct mem_arena * a = (struct mem_arena *)page_reserve(size);
+	if (a == PAGE_FAIL)
+		return NULL;
+
+	arena_region_setup(a, ARENA_COMPRESSED, size);
+	if (arena_map_add(a, size, -1) == 0)
+		return a;
+
+	page_unmap((void *)a, size);
+	return NULL;
+}
+
+/*
+ * @function mem_compressed_close
+ * Unmaps a compressed arena with every block in it. No other thread may use the
+ * arena or its memory during or after the call.
+ *
+ * @param struct mem_arena * a
+ * @return int 0 success, -1 fail
+ */
+int mem_compressed_close(struct mem_arena * a)
+{
+	if (a == NULL || arena_find((void *)a) != a || a->kind != ARENA_COMPRESSED)
+		return -1;
+
+	arena_map_remove(a);
+	return page_unmap((void *)a, a->header.size);
+}
 
-	if (b == p->end)
-		p->end = b->pool_prev;
+/*
+ * @function mem_compressed_alloc
+ * Allocates a block in a compressed arena. The address is the arena plus the
+ * offset shifted left by MEM_COMPRESSED_SHIFT (mem_decompress in gpmalloc.h).
+ *
+ * @param struct mem_arena * a, size_t size
+ * @return uint32_t offset, 0 if fail
+ */
+uint32_t mem_compressed_alloc(struct mem_arena * a, size_t size)
+{
+	void * address = mem_arena_alloc(a, size);
+	return (address == NULL)? 0 : (uint32_t)((size_t)(address - (void *)a) >> MEM_COMPRESSED_SHIFT);
+}
 
-	if (b->pool_prev != NULL)
-		b->pool_prev->pool_next = b->pool_next;
+/*
+ * @function mem_compressed_free
+ * Frees a block of a compressed arena by offset.
+ *
+ * @param struct mem_arena * a, uint32_t offset
+ */
+void mem_compressed_free(struct mem_arena * a, uint32_t offset)
+{
+	if (offset != 0)
+		mem_free((void *)a + ((size_t)offset << MEM_COMPRESSED_SHIFT));
+}
 
-	if (b->pool_next != NULL)
-		b->pool_next->pool_prev = b->pool_prev;
+/*
+ * @function mem_objpool_create
+ * Creates a pool of objects of size bytes aligned to align.
+ *
+ * @param size_t size, size_t align (power of 2 <= page size, 0 for OBJPOOL_ALIGN)
+ * @return struct mem_objpool *, NULL if fail
+ */
+struct mem_objpool * mem_objpool_create(size_t size, size_t align)
+{
+	if (align == 0)
+		align = OBJPOOL_ALIGN;
 
-	b->pool_prev = NULL;
-	b->pool_next = NULL;
+	size_t page = page_size_get();
+	if ((align & (align - 1)) != 0 || align > page || size == 0 || size > SIZE_MAX / 2 / OBJPOOL_SLAB_MIN)
+		return NULL;
 
-	p->size--;
+	struct mem_objpool * p = (struct mem_objpool *)mem_alloc(sizeof(struct mem_objpool));
+	if (p == NULL)
+		return NULL;
 
-	if (p->size <= table[pool_min_index].size)
-		pool_min_index = table_index_get(SIZE_GET(b->size));
+	memset(p, 0, sizeof(struct mem_objpool));
+	p->align = align;
+	p->size = ((size < sizeof(void *))? sizeof(void *) : size) + align - 1;
+	p->size &= ~(align - 1);
 
-	if (p->size >= table[pool_max_index].size)
-		pool_max_index = table_index_get(SIZE_GET(b->size));
+	size_t start = (sizeof(struct objpool_slab) + align - 1) & ~(align - 1);
+	p->slab_size = OBJPOOL_SLAB;
+	if (start + p->size * OBJPOOL_SLAB_MIN > p->slab_size)
+		p->slab_size = (start + p->size * OBJPOOL_SLAB_MIN + page - 1) & ~(page - 1);
 
-	return 0;
+	lock_create(&p->lock);
+	return p;
 }
 
 /*
- * @function pool_search
- * Finds free block >= size
+ * @function objpool_take
+ * Takes a free object, or cuts one from the newest slab, or maps a slab. Lock must be held.
  *
- * @param size_t s
- * @return struct block_free *
+ * @param struct mem_objpool * p
+ * @return void * object, NULL if fail
  */
-struct block_free * pool_search(size_t s, struct pool * p)
+void * objpool_take(struct mem_objpool * p)
 {
-	if (s == 0)
-		return NULL;
+	void * o = p->free;
+	if (o != NULL)
+	{
+		p->free = *(void **)o;
+		return o;
+	}
 
-	if (p == NULL)
-		p = &table[table_index_get(s)];
+	if (p->top == NULL || p->top + p->size > p->end)
+	{
+		struct objpool_slab * slab = (struct objpool_slab *)page_map(p->slab_size);
+		if (slab == PAGE_FAIL)
+			return NULL;
 
-	struct block_free * n = p->start;
-	while (n != NULL)
-		if (SIZE_GET(n->size) >= s)
-			return n;
-		else
-			n = n->pool_next;
+		slab->next = p->slabs;
+		p->slabs = slab;
+		p->top = (char *)slab + ((sizeof(struct objpool_slab) + p->align - 1) & ~(p->align - 1));
+		p->end = (char *)slab + p->slab_size;
+	}
 
-	return NULL;
+	o = p->top;
+	p->top += p->size;
+	return o;
 }
 
 /*
- * @function block_create
- * Creates block >= size. Memory can be retrieved from mmap or sbrk call.
+ * @function objpool_magazine_get
+ * Takes an empty magazine from the depot or makes one. Lock must be held.
  *
- * @param size_t size
- * @return struct block_free *
+ * @param struct mem_objpool * p
+ * @return struct objpool_magazine *, NULL if fail
  */
-struct block * block_create(size_t size)
+struct objpool_magazine * objpool_magazine_get(struct mem_objpool * p)
 {
-	//Min allocation size if not using sbrk
-	#ifndef USE_SBRK
-		if (size < PAGE_MIN_ALLOC * page_size_get())
-			size += PAGE_MIN_ALLOC * page_size_get();
-	#endif
-
-	//Create new block
-	struct block * b = (struct block *)page_get(size + sizeof(struct block_free));
+	struct objpool_magazine * m = p->depot_empty;
+	if (m != NULL)
+	{
+		p->depot_empty = m->next;
+		return m;
+	}
 
-	//Check alloc worked
-	if (b == NULL)
+	m = (struct objpool_magazine *)mem_alloc(sizeof(struct objpool_magazine) + p->magazine * sizeof(void *));
+	if (m == NULL)
 		return NULL;
 
-	#ifdef USE_SBRK
-		if (block_last != NULL)
-			block_last->block_next = b;
-
-		b->block_prev = block_last;
-		block_last = b;
-	#else
-		b->block_prev = NULL;
-	#endif
-
-	b->block_next = NULL;
-	SIZE_SET(b->size, size);
-	SIZE_STATE_SET(b->size, 1);
-	return b;
+	m->pool = p;
+	m->count = 0;
+	m->all = p->magazines;
+	p->magazines = m;
+	return m;
 }
 
 /*
- * @function block_remove
- * Removes block and returns it to the system.
+ * @function objpool_magazine_put
+ * Puts a magazine in the depot. Lock must be held.
  *
- * @param struct block_free * b
- * @return int 0 success, 1 if block is not full width allocation, -1 on fail, 2 on fail try
+ * @param struct objpool_magazine * m
  */
-int block_remove(struct block_free * b)
+void objpool_magazine_put(struct objpool_magazine * m)
 {
-	#ifdef USE_SBRK
-		if ((struct block *)b != block_last)
-			return -1;
+	struct mem_objpool * p = m->pool;
+	struct objpool_magazine ** depot = (m->count == 0)? &p->depot_empty : &p->depot_full;
+	m->next = *depot;
+	*depot = m;
+}
 
-		block_last = b->block_prev;
+/*
+ * @function objpool_thread_exit
+ * Thread exit destructor, returns the thread's magazine to the depot.
+ *
+ * @param void * data (struct objpool_magazine *)
+ */
+void objpool_thread_exit(void * data)
+{
+	struct objpool_magazine * m = (struct objpool_magazine *)data;
+	struct mem_objpool * p = m->pool;
 
-		if (block_last != NULL)
-			block_last->block_next = NULL;
+	lock_wait(&p->lock);
+	objpool_magazine_put(m);
+	lock_signal(&p->lock);
+}
 
-	#else
-		if (b->block_prev != NULL && b->block_next != NULL)
-			return 2;
-	#endif
+/*
+ * @function mem_objpool_magazines
+ * Gives each thread using the pool a magazine of count freed objects it takes
+ * from and frees into without locking. Set once, before the pool is used.
+ *
+ * @param struct mem_objpool * p, unsigned int count
+ * @return int 0 success, -1 fail
+ */
+int mem_objpool_magazines(struct mem_objpool * p, unsigned int count)
+{
+	if (p->magazine != 0 || count == 0 || pthread_key_create(&p->key, objpool_thread_exit) != 0)
+		return -1;
 
-	return page_free((void *)b, SIZE_GET(b->size) + sizeof(struct block_free));
+	p->magazine = count;
+	return 0;
 }
 
 /*
- * @function block_split
- * Splits free block into a block = to size and a free block. Free block is added to a pool.
+ * @function mem_objpool_alloc
+ * Gets an object from pool. Contents are undefined.
  *
- * @param size_t size, struct block_free * b (block not in pool)
- * @return struct block *
+ * @param struct mem_objpool * p
+ * @return void * object, NULL if fail
  */
-struct block * block_split(size_t size, struct block_free * b)
+void * mem_objpool_alloc(struct mem_objpool * p)
 {
-	if (size == 0 || b == NULL)
-		return NULL;
+	struct objpool_magazine * m = NULL;
+	if (p->magazine != 0)
+	{
+		m = (struct objpool_magazine *)pthread_getspecific(p->key);
+		if (m != NULL && m->count != 0)
+			return m->objects[--m->count];
+	}
 
-	//Check if size if < b->size and that a free block will fit
-	if (size >= b->size || size + sizeof(struct block_free) + 1 > SIZE_GET(b->size))
-		return NULL;
+	lock_wait(&p->lock);
+	if (p->magazine == 0)
+	{
+		void * o = objpool_take(p);
+		lock_signal(&p->lock);
+		return o;
+	}
 
-	struct block * n = (struct block *)b;
+	//Swap for a magazine other threads filled, else fill half of it
+	if (m == NULL || p->depot_full != NULL)
+	{
+		struct objpool_magazine * full = p->depot_full;
+		if (full != NULL)
+			p->depot_full = full->next;
+		else
+			full = objpool_magazine_get(p);
 
-	b = (struct block_free *)((size_t)b + sizeof(struct block) + size);
-	SIZE_SET(b->size, SIZE_GET(n->size) - (size + sizeof(struct block_free)));
-	SIZE_STATE_SET(b->size, 0);
-	b->block_next = NULL;
-	b->block_prev = n;
-	b->block_next = n->block_next;
-	if (pool_insert(b) == -1)
-		return NULL;
+		if (full != NULL && pthread_setspecific(p->key, full) != 0)
+		{
+			objpool_magazine_put(full);
+			full = NULL;
+		}
 
-	n->block_next = (struct block *)b;
-	SIZE_SET(n->size, size);
-	SIZE_STATE_SET(n->size, 1);
-	return n;
+		if (full != NULL && m != NULL)
+			objpool_magazine_put(m);
+
+		if (full != NULL)
+			m = full;
+	}
+
+	void * o = NULL;
+	if (m != NULL)
+	{
+		while (m->count < (p->magazine + 1) / 2 && (o = objpool_take(p)) != NULL)
+			m->objects[m->count++] = o;
+
+		o = (m->count != 0)? m->objects[--m->count] : NULL;
+	}
+	else
+		o = objpool_take(p);
+	lock_signal(&p->lock);
+
+	return o;
 }
 
 /*
- * @function block_join
- * Joins with right and remove right from pool,
- * and join with left block but will not remove b from pool.
+ * @function mem_objpool_free
+ * Returns an object to the pool it came from.
  *
- * @param struct block_free * b
- * @returns int 0 success, -1 fail
+ * @param struct mem_objpool * p, void * object
  */
-int block_join(struct block_free * b)
+void mem_objpool_free(struct mem_objpool * p, void * object)
 {
-	if (b == NULL || SIZE_IS_USED(b->size))
-		return -1;
+	if (object == NULL)
+		return;
 
-	//Join with right
-	if (b->block_next != NULL && !SIZE_IS_USED(b->block_next->size))
+	struct objpool_magazine * m = NULL;
+	if (p->magazine != 0)
 	{
-		pool_remove((struct block_free *)b->block_next);
-		SIZE_SET(b->size, SIZE_GET(b->block_next->size) + sizeof(struct block_free));
-
-		b->block_next = b->block_next->block_next;
-		if (b->block_next != NULL)
-			b->block_next->block_prev = (struct block *)b;
-		pool_insert(b);
+		m = (struct objpool_magazine *)pthread_getspecific(p->key);
+		if (m != NULL && m->count < p->magazine)
+		{
+			m->objects[m->count++] = object;
+			return;
+		}
 	}
 
-	//Join with left
-	if (b->block_prev != NULL && !SIZE_IS_USED(b->block_prev->size))
+	lock_wait(&p->lock);
+	if (p->magazine != 0)
 	{
-		pool_remove((struct block_free *)b->block_prev);
-		SIZE_SET(b->block_prev->size, SIZE_GET(b->size) + sizeof(struct block_free));
-		b->block_prev->block_next = b->block_next;
+		//Full magazine goes to the depot for other threads
+		struct objpool_magazine * empty = objpool_magazine_get(p);
+		if (empty != NULL && pthread_setspecific(p->key, empty) != 0)
+		{
+			objpool_magazine_put(empty);
+			empty = NULL;
+		}
 
-		if (b->block_next != NULL)
-			b->block_next->block_prev = b->block_prev;
-		pool_insert((struct block_free *)b->block_prev);
+		if (empty != NULL)
+		{
+			if (m != NULL)
+				objpool_magazine_put(m);
+
+			empty->objects[empty->count++] = object;
+			lock_signal(&p->lock);
+			return;
+		}
 	}
 
-	return 0;
+	*(void **)object = p->free;
+	p->free = object;
+	lock_signal(&p->lock);
 }
 
 /*
- * @function mem_init
- * Sets up memory allocator pools.
+ * @function mem_objpool_destroy
+ * Frees pool with every object and magazine in it. No thread may use the pool
+ * during or after.
+ *
+ * @param struct mem_objpool * p
  */
-void mem_init(void)
+void mem_objpool_destroy(struct mem_objpool * p)
 {
-	//Setup mutex lock statically
-	#if defined(__linux) && !defined(USE_LOCK_SPIN)
-		static lock_t l = PTHREAD_MUTEX_INITIALIZER;
-	#else
-		static lock_t l = 0;
-	#endif
+	if (p == NULL)
+		return;
 
-	lock_wait(&l);
-	
-	static bool complete = false;
-	if (complete == true)
+	if (p->magazine != 0)
+		pthread_key_delete(p->key);
+
+	for (struct objpool_magazine * m = p->magazines, * next; m != NULL; m = next)
 	{
-		lock_signal(&l);
-		return;
+		next = m->all;
+		mem_free(m);
 	}
 
-	pool_min_index = 0;
-	pool_max_index = 0;
-
-	memset(table, 0, sizeof(table));
-	block_last = NULL;
+	for (struct objpool_slab * slab = p->slabs, * next; slab != NULL; slab = next)
+	{
+		next = slab->next;
+		page_unmap(slab, p->slab_size);
+	}
 
-	complete = true;
-	lock_signal(&l);
+	lock_remove(&p->lock);
+	mem_free(p);
 }
 
 /*
- * @function mem_alloc
- * Get block of memory >= size. (internal malloc)
+ * @function epoch_thread_get
+ * Record of the calling thread, taken from an exited thread or made.
  *
- * @param size_t size
- * @return void * address
+ * @return struct epoch_thread *, NULL if fail
  */
-void * mem_alloc(size_t size)
+struct epoch_thread * epoch_thread_get(void)
 {
-	if (size == 0)
-		return NULL;
+	struct epoch_thread * t = epoch_self;
+	if (t != NULL)
+		return t;
 
-	//Setup allocator if needed.
 	mem_init();
+	for (t = __atomic_load_n(&epoch_threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next)
+	{
+		int open = 0;
+		if (__atomic_load_n(&t->taken, __ATOMIC_RELAXED) == 0 && __atomic_compare_exchange_n(&t->taken, &open, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
 
-	//Get index of pool that could contain free block
-	unsigned int index = table_index_get(size);
-	struct block_free * b = pool_search(size, NULL);
+	if (t == NULL)
+	{
+		t = (struct epoch_thread *)mem_alloc(sizeof(struct epoch_thread));
+		if (t == NULL)
+			return NULL;
 
-	if (b == NULL)
-		b = pool_search(size, &table[pool_max_index]);
+		memset(t, 0, sizeof(struct epoch_thread));
+		t->taken = 1;
+		t->next = __atomic_load_n(&epoch_threads, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&epoch_threads, &t->next, t, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
 
-	//If no block was found the create new one.
-	if (b == NULL)
+	//Destructor hands the limbo lists over when the thread exits
+	if (pthread_setspecific(epoch_key, t) != 0)
 	{
-		struct block * n = block_create(size);
-		return (n == NULL)? NULL : (void *)n + sizeof(struct block);
+		__atomic_store_n(&t->taken, 0, __ATOMIC_RELEASE);
+		return NULL;
 	}
 
-	//If block is perfect size return it.
-	if (size + sizeof(struct block_free) + 1 > SIZE_GET(b->size))
+	epoch_self = t;
+	return t;
+}
+
+/*
+ * @function epoch_advance
+ * Moves the global epoch on if every thread inside entered in the current one.
+ *
+ * @return size_t global epoch
+ */
+size_t epoch_advance(void)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	size_t e = __atomic_load_n(&epoch_global, __ATOMIC_ACQUIRE);
+
+	for (struct epoch_thread * t = __atomic_load_n(&epoch_threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next)
 	{
-		SIZE_STATE_SET(b->size, 1);
-		return (void *)b + sizeof(struct block);
+		size_t seen = __atomic_load_n(&t->epoch, __ATOMIC_ACQUIRE);
+		if ((seen & 1) != 0 && (seen >> 1) != e)
+			return e;
 	}
 
-	//Split block and return.
-	struct block * n = block_split(size, b);
-	return (n == NULL)? NULL : (void *)n + sizeof(struct block);
+	//Fails if another thread moved it first, e is then the new epoch
+	if (__atomic_compare_exchange_n(&epoch_global, &e, e + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return e + 1;
+
+	return e;
 }
 
 /*
- * @function mem_free
- * Frees allocated memory
+ * @function epoch_limbo_free
+ * Frees every node and bag of a limbo list.
  *
- * @param void * address
+ * @param struct epoch_bag * list
  */
-void mem_free(void * address)
+void epoch_limbo_free(struct epoch_bag * list)
 {
-	if (address == NULL)
-		return;
+	while (list != NULL)
+	{
+		struct epoch_bag * next = list->next;
+		for (unsigned int i = 0; i < list->count; ++i)
+			mem_free(list->nodes[i]);
 
-	struct block_free * b = (struct block_free *)(address - sizeof(struct block));
+		mem_free(list);
+		list = next;
+	}
+}
 
-	if (SIZE_IS_USED(b->size) == 0)
-		return; //Error address is not a used block
+/*
+ * @function epoch_limbo_push
+ * Adds node to the bag at the head of a limbo list, a new bag is taken when it is full.
+ *
+ * @param struct epoch_bag ** list, void * node
+ * @return int 0 success, -1 fail
+ */
+int epoch_limbo_push(struct epoch_bag ** list, void * node)
+{
+	struct epoch_bag * bag = *list;
+	if (bag == NULL || bag->count == EPOCH_BATCH)
+	{
+		bag = (struct epoch_bag *)mem_alloc(sizeof(struct epoch_bag));
+		if (bag == NULL)
+			return -1;
 
-	//Try to remove block if using mmap
-	#ifndef USE_SBRK
-		if (block_remove(b))
-			return;
-	#endif
+		bag->next = *list;
+		bag->count = 0;
+		__atomic_store_n(list, bag, __ATOMIC_RELAXED);
+	}
 
-	SIZE_STATE_SET(b->size, 0);
-	if ((struct block *)b == block_last)
+	bag->nodes[bag->count++] = node;
+	return 0;
+}
+
+/*
+ * @function epoch_collect
+ * Frees limbo lists deferred at least 2 epochs before epoch. A reader inside
+ * then entered after the nodes were unlinked.
+ *
+ * @param struct epoch_bag ** limbo, size_t * limbo_epoch, size_t epoch
+ */
+void epoch_collect(struct epoch_bag ** limbo, size_t * limbo_epoch, size_t epoch)
+{
+	for (unsigned int i = 0; i < 3; ++i)
 	{
-		block_remove(b);
-		return;
+		if (limbo[i] == NULL || limbo_epoch[i] + 2 > epoch)
+			continue;
+
+		struct epoch_bag * list = limbo[i];
+		__atomic_store_n(&limbo[i], NULL, __ATOMIC_RELAXED);
+		epoch_limbo_free(list);
 	}
+}
 
-	//Join block
-	SIZE_STATE_SET(b->size, 0);
-	b->pool_prev = NULL;
-	b->block_next = NULL;
-	block_join(b);
+/*
+ * @function epoch_reclaim
+ * Moves the epoch on as far as readers allow, up to the 2 epochs a node deferred
+ * now waits, then frees what is safe of the thread's and exited threads' lists.
+ *
+ * @param struct epoch_thread * t (NULL for exited threads' lists only)
+ */
+void epoch_reclaim(struct epoch_thread * t)
+{
+	size_t e = epoch_advance();
+	e = epoch_advance();
+
+	if (t != NULL)
+		epoch_collect(t->limbo, t->limbo_epoch, e);
+
+	bool orphans = false;
+	for (unsigned int i = 0; i < 3; ++i)
+		orphans |= __atomic_load_n(&epoch_orphan[i], __ATOMIC_RELAXED) != NULL;
+
+	if (orphans)
+	{
+		lock_wait(&lock_epoch);
+		epoch_collect(epoch_orphan, epoch_orphan_epoch, e);
+		lock_signal(&lock_epoch);
+	}
 }
 
 /*
- * @function mem_calloc
- * Allocates memory array
+ * @function mem_epoch_enter
+ * Starts a read section, nodes loaded from shared structures inside stay valid
+ * until mem_epoch_exit. Sections nest.
  *
- * @param size_t number of nodes, size_t sizeof node
+ * @return int 0 success, -1 fail
  */
-void * mem_calloc(size_t n, size_t size)
+int mem_epoch_enter(void)
 {
-	void * address = mem_alloc(size * size);
-	if (address == NULL)
-		return NULL;
+	struct epoch_thread * t = epoch_thread_get();
+	if (t == NULL)
+		return -1;
 
-	memset(address, 0, size);
-	return address;
+	if (t->nest++ == 0)
+	{
+		size_t e = __atomic_load_n(&epoch_global, __ATOMIC_RELAXED);
+		__atomic_store_n(&t->epoch, (e << 1) | 1, __ATOMIC_RELAXED);
+
+		//Announce is seen before the section loads shared nodes
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+
+	return 0;
 }
 
 /*
- * @function mem_realloc
- * Reallocates memory into new block of size
+ * @function mem_epoch_exit
+ * Ends a read section, nodes loaded inside must not be used after.
+ */
+void mem_epoch_exit(void)
+{
+	struct epoch_thread * t = epoch_self;
+	if (t == NULL || t->nest == 0)
+		return;
+
+	if (--t->nest == 0)
+		__atomic_store_n(&t->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * @function mem_free_deferred
+ * Frees memory once no read section that may still hold it is left. The caller
+ * must have unlinked it so no new section can load it. Frees are batched, every
+ * EPOCH_BATCH calls the thread tries to advance the epoch and reclaim.
  *
- * @param void * adrdess, size_t new size
+ * @param void * address
  */
-void * mem_realloc(void * address, size_t size)
+void mem_free_deferred(void * address)
 {
 	if (address == NULL)
-		return NULL;
+		return;
 
-	void * temp = mem_alloc(size);
-	if (temp == NULL)
-		return NULL;
+	struct epoch_thread * t = epoch_thread_get();
 
-	memcpy(temp, (const void *)address, size);
-	mem_free(address);
-	return temp;
+	//Epoch is read after the caller unlinked the node
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	size_t e = __atomic_load_n(&epoch_global, __ATOMIC_RELAXED);
+
+	//A node no bag can hold is never freed rather than freed early
+	if (t == NULL)
+	{
+		struct epoch_bag * list = NULL;
+		if (epoch_limbo_push(&list, address) != 0)
+			return;
+
+		lock_wait(&lock_epoch);
+		epoch_limbo_merge(epoch_orphan, epoch_orphan_epoch, list, e);
+		lock_signal(&lock_epoch);
+		return;
+	}
+
+	//Slot holds a list 3 or more epochs old, it is safe
+	unsigned int i = e % 3;
+	if (t->limbo_epoch[i] != e)
+	{
+		epoch_limbo_free(t->limbo[i]);
+		t->limbo[i] = NULL;
+		t->limbo_epoch[i] = e;
+	}
+
+	if (epoch_limbo_push(&t->limbo[i], address) != 0)
+		return;
+
+	if (++t->count >= EPOCH_BATCH)
+	{
+		t->count = 0;
+		epoch_reclaim(t);
+	}
 }
 
-#ifdef DEBUG
+/*
+ * @function mem_epoch_reclaim
+ * Frees deferred memory that is safe now. Outside a read section and with no
+ * other reader inside, everything the thread deferred is freed.
+ */
+void mem_epoch_reclaim(void)
+{
+	epoch_reclaim(epoch_self);
+}
+
+#if defined(DEBUG) && !defined(NO_DEBUG_MAIN)
 
 /*
  * Converts timespec to double
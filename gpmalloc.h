@@ -8,4 +8,286 @@
 #ifndef GPMALLOC_GPMALLOC_H
 #define GPMALLOC_GPMALLOC_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	void * mem_alloc(size_t);
+	void * mem_calloc(size_t, size_t);
+	void * mem_realloc(void *, size_t);
+	void mem_free(void *);
+
+	//Bytes a block can hold, and allocation that tells them
+	size_t mem_usable_size(void *);
+	void * mem_alloc_at_least(size_t, size_t *);
+
+	//Hints, short lived, long lived and hot blocks come from arenas of their own (first one set
+	//wins) so they do not pin each other's pages. Zeroed is calloc, and may be combined
+	#define MEM_SHORT_LIVED 1
+	#define MEM_LONG_LIVED 2
+	#define MEM_HOT 4 //Kept together on pages faulted in ahead
+	#define MEM_ZEROED 8
+
+	void * mem_alloc_flags(size_t, unsigned int);
+
+	//Size classes
+	unsigned int mem_classes_build(double, unsigned int *, unsigned int);
+	int mem_classes_apply(const unsigned int *, unsigned int);
+	void mem_histogram_reset(void);
+	int mem_profile_save(const char *, double);
+	int mem_profile_load(const char *);
+
+	//Runtime configuration
+	int mem_config(const char *);
+
+	//Thread cache, small blocks freed in the main arena are kept by the thread that freed them.
+	//Bins are MEM_TCACHE_STEP bytes apart, a block sits in the bin of its size rounded down,
+	//a request looks in the bin of its size rounded up. Bins link through the first payload word
+	#define MEM_TCACHE_MAX 256
+	#define MEM_TCACHE_STEP 8
+	#define MEM_TCACHE_BINS (MEM_TCACHE_MAX / MEM_TCACHE_STEP + 1)
+	#define MEM_TCACHE_BIN(s) (((s) < 2 * MEM_TCACHE_STEP)? 2 : ((s) + MEM_TCACHE_STEP - 1) / MEM_TCACHE_STEP)
+
+	struct mem_tcache
+	{
+		void * bin[MEM_TCACHE_BINS];
+		unsigned int count[MEM_TCACHE_BINS];
+		int registered; //Destructor set for this thread
+	};
+
+	extern __thread struct mem_tcache mem_tcache;
+	extern unsigned int mem_tcache_limit; //Blocks per bin, 0 until the allocator is set up
+	void * mem_tcache_alloc(unsigned int);
+
+	//Lock counters summed over allocator locks
+	struct mem_lock_stats
+	{
+		size_t acquires; //Times a lock was taken
+		size_t contended; //Times it was not open on the first try
+		size_t sleeps; //Times a thread parked waiting for it
+	};
+
+	void mem_lock_stats_get(struct mem_lock_stats *);
+
+	//Heap walking, callbacks run with the heap locked and must not allocate or free
+	#define MEM_HEAP_HISTOGRAM 32
+
+	struct mem_span
+	{
+		void * address; //Payload
+		size_t size; //Payload bytes
+		int used;
+		int mapped; //Span is in its own mapping rather than the sbrk heap
+		unsigned int segment; //Index of the mapping or heap run holding the span
+	};
+
+	struct mem_heap_stats
+	{
+		size_t segments;
+		size_t heap_bytes; //Bytes taken from the system, headers included
+		size_t used_blocks;
+		size_t used_bytes;
+		size_t free_blocks;
+		size_t free_bytes;
+		size_t free_largest;
+		double fragmentation; //1 - free_largest / free_bytes
+		size_t free_histogram[MEM_HEAP_HISTOGRAM]; //Free blocks of 2^i to 2^(i + 1) - 1 bytes
+	};
+
+	size_t mem_heap_walk(void (*)(const struct mem_span *, void *), void *);
+	void mem_heap_stats_get(struct mem_heap_stats *);
+	int mem_heap_dump(int);
+
+	//Memory faulted in ahead of use, kept as heap headroom
+	#define MEM_RESERVE_LOCK 1 //Lock the pages in memory
+
+	int mem_reserve(size_t, unsigned int);
+	int mem_reserve_class(size_t, size_t, unsigned int);
+
+	//Arenas over a fixed region, their memory is freed with mem_free
+	struct mem_arena;
+	void * mem_arena_alloc(struct mem_arena *, size_t);
+
+	//Persistent arena, a file mapped at a fixed address
+	struct mem_arena * mem_persist_open(const char *, void *, size_t);
+	int mem_persist_close(struct mem_arena *);
+	void mem_persist_root_set(struct mem_arena *, void *);
+	void * mem_persist_root_get(struct mem_arena *);
+
+	//Shared arena, shm_open or memfd memory several processes allocate from and free into.
+	//Each process may map it at its own address, hand over offsets rather than pointers
+	struct mem_arena * mem_shared_open(const char *, size_t);
+	struct mem_arena * mem_shared_attach(int);
+	int mem_shared_close(struct mem_arena *);
+	int mem_shared_fd(struct mem_arena *);
+	size_t mem_shared_offset(struct mem_arena *, void *);
+	void * mem_shared_pointer(struct mem_arena *, size_t);
+
+	//Compressed arena, a reserved region of up to 4G << MEM_COMPRESSED_SHIFT whose blocks are named by
+	//32-bit offsets in units of 1 << MEM_COMPRESSED_SHIFT bytes from the arena. Offset 0 is NULL
+	#define MEM_COMPRESSED_SHIFT 3 //Payloads are 8 byte aligned
+
+	struct mem_arena * mem_compressed_open(size_t);
+	int mem_compressed_close(struct mem_arena *);
+	uint32_t mem_compressed_alloc(struct mem_arena *, size_t);
+	void mem_compressed_free(struct mem_arena *, uint32_t);
+
+	/*
+	 * @function mem_decompress
+	 * Address of a block of a compressed arena.
+	 *
+	 * @param struct mem_arena * a, uint32_t offset
+	 * @return void * address, NULL for 0
+	 */
+	static inline void * mem_decompress(struct mem_arena * a, uint32_t offset)
+	{
+		return (offset == 0)? NULL : (void *)((char *)a + ((size_t)offset << MEM_COMPRESSED_SHIFT));
+	}
+
+	/*
+	 * @function mem_compress
+	 * Offset of an address in a compressed arena.
+	 *
+	 * @param struct mem_arena * a, void * address
+	 * @return uint32_t offset, 0 for NULL
+	 */
+	static inline uint32_t mem_compress(struct mem_arena * a, void * address)
+	{
+		return (address == NULL)? 0 : (uint32_t)((size_t)((char *)address - (char *)a) >> MEM_COMPRESSED_SHIFT);
+	}
+
+	//Object pools, objects of one size in slabs of their own. Magazines keep freed objects per thread,
+	//destroy frees every object at once
+	struct mem_objpool;
+	struct mem_objpool * mem_objpool_create(size_t, size_t);
+	int mem_objpool_magazines(struct mem_objpool *, unsigned int);
+	void * mem_objpool_alloc(struct mem_objpool *);
+	void mem_objpool_free(struct mem_objpool *, void *);
+	void mem_objpool_destroy(struct mem_objpool *);
+
+	//Deferred frees for lock-free structures. Readers enter before loading shared nodes and exit
+	//after, a node unlinked and passed to mem_free_deferred is freed once every reader that may
+	//still hold it has exited. Reclaim frees what is safe now
+	int mem_epoch_enter(void);
+	void mem_epoch_exit(void);
+	void mem_free_deferred(void *);
+	void mem_epoch_reclaim(void);
+
+	//Background frees, with async_min set large and mapped blocks are queued for an allocator
+	//thread. Flush returns once every free queued before it is done
+	void mem_free_flush(void);
+
+	//Block header in front of every payload, checked against struct block and SIZE_* in gpmalloc.c
+	#define MEM_BLOCK_HEADER 24
+	#define MEM_BLOCK_USED ((size_t)1 << (sizeof(size_t) * 8 - 1))
+	#define MEM_BLOCK_ZERO ((size_t)1 << (sizeof(size_t) * 8 - 2))
+	#define MEM_BLOCK_MAPPED ((size_t)1 << (sizeof(size_t) * 8 - 3))
+	#define MEM_BLOCK_ARENA ((size_t)3 << (sizeof(size_t) * 8 - 5))
+	#define MEM_BLOCK_REGION ((size_t)1 << (sizeof(size_t) * 8 - 6))
+	#define MEM_BLOCK_SIZE_MASK (SIZE_MAX >> 6)
+
+	/*
+	 * @function mem_alloc_fast
+	 * mem_alloc with the thread cache inlined for sizes known at compile time, the
+	 * bin is then a constant. Other sizes call mem_alloc. Inlined allocations are
+	 * not counted in the size class histogram.
+	 *
+	 * @param size_t size
+	 * @return void * address, NULL if fail
+	 */
+	static inline __attribute__((always_inline)) void * mem_alloc_fast(size_t size)
+	{
+		if (!__builtin_constant_p(size) || size == 0 || size > MEM_TCACHE_MAX)
+			return mem_alloc(size);
+
+		unsigned int i = MEM_TCACHE_BIN(size);
+		void * address = mem_tcache.bin[i];
+		if (__builtin_expect(address == NULL, 0))
+			return mem_tcache_alloc(i);
+
+		mem_tcache.bin[i] = *(void **)address;
+		mem_tcache.count[i]--;
+		return address;
+	}
+
+	/*
+	 * @function mem_free_fast
+	 * mem_free with the thread cache inlined. Mapped and large blocks, blocks of
+	 * hint and region arenas, full bins and threads whose cache is not set up
+	 * yet call mem_free.
+	 *
+	 * @param void * address
+	 */
+	static inline __attribute__((always_inline)) void mem_free_fast(void * address)
+	{
+		if (address != NULL)
+		{
+			size_t * header = (size_t *)((char *)address - MEM_BLOCK_HEADER);
+			size_t word = *header;
+			size_t size = word & MEM_BLOCK_SIZE_MASK;
+			size_t i = size / MEM_TCACHE_STEP;
+
+			if ((word & (MEM_BLOCK_USED | MEM_BLOCK_MAPPED | MEM_BLOCK_ARENA | MEM_BLOCK_REGION)) == MEM_BLOCK_USED && size <= MEM_TCACHE_MAX && mem_tcache.registered != 0
+				&& mem_tcache.count[i] < __atomic_load_n(&mem_tcache_limit, __ATOMIC_RELAXED))
+			{
+				*header = word & ~MEM_BLOCK_ZERO;
+				*(void **)address = mem_tcache.bin[i];
+				mem_tcache.bin[i] = address;
+				mem_tcache.count[i]++;
+				return;
+			}
+		}
+
+		mem_free(address);
+	}
+
+	#ifndef USE_PREFIX
+		#define malloc mem_alloc_fast
+		#define calloc mem_calloc
+		#define realloc mem_realloc
+		#define free mem_free_fast
+	#endif /* end of not USE_PREFIX */
+
+#ifdef __cplusplus
+};  /* end of extern "C" */
+
+/*
+ * @function mem_alloc_sized
+ * mem_alloc_fast for a size given as template argument.
+ *
+ * @return void * address, NULL if fail
+ */
+template <size_t Size>
+inline void * mem_alloc_sized()
+{
+	static_assert(Size > 0, "mem_alloc_sized of 0 bytes");
+	if (Size > MEM_TCACHE_MAX)
+		return mem_alloc(Size);
+
+	const unsigned int i = (Size > MEM_TCACHE_MAX)? 0 : MEM_TCACHE_BIN(Size);
+	void * address = mem_tcache.bin[i];
+	if (__builtin_expect(address == NULL, 0))
+		return mem_tcache_alloc(i);
+
+	mem_tcache.bin[i] = *(void **)address;
+	mem_tcache.count[i]--;
+	return address;
+}
+
+/*
+ * @function mem_alloc_type
+ * Uninitialised memory for one T, free with mem_free_fast or mem_free.
+ *
+ * @return T * address, NULL if fail
+ */
+template <class T>
+inline T * mem_alloc_type()
+{
+	return static_cast<T *>(mem_alloc_sized<sizeof(T)>());
+}
+#endif
+
 #endif //GPMALLOC_GPMALLOC_H
@@ -6,16 +6,30 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <time.h>
 #include <stdio.h>
-#include <zconf.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
 
 #if defined(__linux) || defined(__unix)
+	#include <unistd.h>
 	#include <sys/resource.h>
 	#include <memory.h>
 	#include <errno.h>
+	#include <sys/wait.h>
 #endif
 
+#if defined(__x86_64__) || defined(__i386__)
+	#include <x86intrin.h>
+#endif
+
+#include "workload.h"
+
+#define USE_PREFIX
+#include "../gpmalloc.h"
+
 //Options base
 #define STEPS 20000
 #define POINTER_NUMBER 1024
@@ -27,13 +41,37 @@
 #define SIZE_ALLOC_MIN 1
 //#define SIZE_ALLOC_FIXED
 
-//Options functions
-#define __malloc malloc
-#define __free free
+//Options functions, gpmalloc is timed, malloc, free and realloc time the system allocator
+#define __malloc mem_alloc
+#define __free mem_free
+#define __realloc mem_realloc
+#define REALLOC_PERCENT 25 //Steps that resize the pointer instead of replacing it
+
+//Options timing, rdtsc (x86) or CLOCK_MONOTONIC_RAW with the timer cost removed
+#define TIMER_PRECISE
+//#define TIMER_NO_TSC
+#define HISTOGRAM_SUB_BITS 6 //2^bits buckets per power of two, ~1.6% precision
+#define CALIBRATE_TIME 0.05 //Seconds used to measure the tsc rate
+
+//Options workload, operations from test/workload.c instead of rand()
+//#define WORKLOAD
+//#define WORKLOAD_COMPARE "compare.csv" //Runs the workload under gpmalloc and glibc instead, .json for JSON
+#define WORKLOAD_SAMPLE 500 //Operations between compare samples
 
 //Options results
 #define FILE_DUMP
 
+//Options checks, "analysis check" runs them instead of the timing run
+#define CHECK_THREADS 4 //Readers and writers each
+#define CHECK_STEPS 100000 //Operations per writer
+#define CHECK_SLOTS 64
+#define CHECK_CONF "async_min:64K,async_limit:2M" //Set before the allocator is used
+#define CHECK_FORKS 20
+#define CHECK_MAGAZINE 32 //Objects per objpool magazine
+#define CHECK_RING 256 //Objects in flight from a producer to its consumer
+#define CHECK_REGION (16 * 1024 * 1024) //Size of persistent and shared arenas
+#define CHECK_NODES 1000 //Nodes of the persistent arena check per process
+
 
 struct pointer
 {
@@ -43,6 +81,54 @@ struct pointer
 
 struct pointer pointers[POINTER_NUMBER];
 
+//Workload phases, run in order
+const struct workload_phase workload_phases[] = {
+	{WORKLOAD_SIZE_JSON, WORKLOAD_LIFETIME_GENERATIONAL, STEPS / 4, SIZE_ALLOC_MIN, SIZE_ALLOC_MAX, 0, 10},
+	{WORKLOAD_SIZE_REDIS, WORKLOAD_LIFETIME_LONG, STEPS / 4, SIZE_ALLOC_MIN, 0, 0, 0},
+	{WORKLOAD_SIZE_POWER_LAW, WORKLOAD_LIFETIME_SHORT, STEPS / 4, 16, SIZE_ALLOC_MAX, 1.1, 0},
+	{WORKLOAD_SIZE_BIMODAL, WORKLOAD_LIFETIME_GENERATIONAL, STEPS / 4, 16, SIZE_ALLOC_MAX, 0, 5}
+};
+
+const struct workload_config workload_config = {
+	workload_phases,
+	sizeof(workload_phases) / sizeof(workload_phases[0]),
+	POINTER_NUMBER,
+	SEED,
+	WORKLOAD_SAMPLE
+};
+
+const char * call_names[] = {"malloc", "free", "realloc"};
+
+#ifdef WORKLOAD_COMPARE
+	const struct workload_allocator allocators[] = {
+		{"gpmalloc", mem_alloc, mem_free, mem_realloc},
+		{"glibc", malloc, free, realloc}
+	};
+#endif
+
+#if defined(TIMER_PRECISE) && !defined(TIMER_NO_TSC) && (defined(__x86_64__) || defined(__i386__))
+	#define TIMER_TSC
+#endif
+
+//Log linear latency histogram, values < 2 * 2^HISTOGRAM_SUB_BITS are exact
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB)
+
+struct histogram
+{
+	uint64_t counts[HISTOGRAM_BUCKETS];
+	uint64_t total;
+	uint64_t max;
+};
+
+struct histogram histogram_malloc;
+struct histogram histogram_free;
+struct histogram histogram_realloc;
+
+//Timer ticks per ns and cost of reading the timer in ticks
+double timer_rate = 1.0;
+uint64_t timer_overhead = 0;
+
 /*
  * Converts timespec to double
  *
@@ -56,37 +142,992 @@ double time_to_double(struct timespec time)
 }
 
 /*
- * Calculates uncertainty of timespec function
+ * Reads the timer
+ *
+ * @return uint64_t ticks (ns unless TIMER_TSC)
+ */
+static inline uint64_t timer_now(void)
+{
+	#if defined(TIMER_TSC)
+		//Keep earlier instructions out of the measured region
+		_mm_lfence();
+		uint64_t t = __rdtsc();
+		_mm_lfence();
+		return t;
+	#else
+		struct timespec ts;
+		#if defined(TIMER_PRECISE) && defined(CLOCK_MONOTONIC_RAW)
+			if (clock_gettime(CLOCK_MONOTONIC_RAW, &ts) != 0)
+		#else
+			if (timespec_get(&ts, TIME_UTC) == 0)
+		#endif
+		{
+			printf("ERROR: Could not record resource usage.\n");
+			exit(EXIT_FAILURE);
+		}
+
+		return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+	#endif
+}
+
+/*
+ * Converts timer ticks to seconds
+ *
+ * @param uint64_t ticks
+ * @return double time
+ */
+double timer_seconds(uint64_t ticks)
+{
+	return (double)ticks / timer_rate / 1000000000.0;
+}
+
+/*
+ * Ticks between two timer reads with the timer cost removed
+ *
+ * @param uint64_t start, uint64_t end
+ * @return uint64_t ticks
+ */
+uint64_t timer_elapsed(uint64_t start, uint64_t end)
+{
+	uint64_t t = end - start;
+	return (t > timer_overhead)? t - timer_overhead : 0;
+}
+
+/*
+ * Measures timer rate and cost. The cost is the least time seen between two
+ * reads, so it is never more than what is subtracted from a real call.
+ */
+void timer_calibrate(void)
+{
+	#ifdef TIMER_TSC
+		struct timespec a, b;
+		clock_gettime(CLOCK_MONOTONIC_RAW, &a);
+		uint64_t start = timer_now();
+		do
+			clock_gettime(CLOCK_MONOTONIC_RAW, &b);
+		while (time_to_double(b) - time_to_double(a) < CALIBRATE_TIME);
+		uint64_t end = timer_now();
+
+		timer_rate = (double)(end - start) / ((time_to_double(b) - time_to_double(a)) * 1000000000.0);
+	#endif
+
+	timer_overhead = UINT64_MAX;
+	for (int i = 0; i < UNCERTAINTY_STEPS; ++i)
+	{
+		uint64_t start = timer_now();
+		uint64_t end = timer_now();
+		if (end - start < timer_overhead)
+			timer_overhead = end - start;
+	}
+}
+
+/*
+ * Calculates uncertainty of the timer, the average cost of a read
  *
  * @return double time
  */
 double uncertainty_get(void)
 {
-	double uncertainty = 0;
+	uint64_t uncertainty = 0;
 	for (int i = 0; i < UNCERTAINTY_STEPS; ++i)
 	{
-		struct timespec ts_start;
-		if (timespec_get(&ts_start, TIME_UTC) == 0) {
-			printf("ERROR: Could not record resource usage.\n");
+		uint64_t start = timer_now();
+		uint64_t end = timer_now();
+		uncertainty += end - start;
+	}
+
+	return timer_seconds(uncertainty) / UNCERTAINTY_STEPS;
+}
+
+/*
+ * Adds value to histogram
+ *
+ * @param struct histogram * h, uint64_t value
+ */
+void histogram_record(struct histogram * h, uint64_t value)
+{
+	unsigned int index;
+	if (value < 2 * HISTOGRAM_SUB)
+		index = (unsigned int)value;
+	else
+	{
+		unsigned int shift = (unsigned int)(63 - __builtin_clzll(value)) - HISTOGRAM_SUB_BITS;
+		index = shift * HISTOGRAM_SUB + (unsigned int)(value >> shift);
+	}
+
+	h->counts[index]++;
+	h->total++;
+	if (value > h->max)
+		h->max = value;
+}
+
+/*
+ * Highest value at percentile p, within the precision of a bucket
+ *
+ * @param const struct histogram * h, double p (0 - 100)
+ * @return uint64_t value
+ */
+uint64_t histogram_percentile(const struct histogram * h, double p)
+{
+	uint64_t target = (uint64_t)((double)h->total * p / 100.0 + 0.5);
+	if (target == 0)
+		target = 1;
+
+	uint64_t count = 0;
+	for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+	{
+		count += h->counts[i];
+		if (count < target)
+			continue;
+
+		if (i < 2 * HISTOGRAM_SUB)
+			return i;
+
+		unsigned int shift = i / HISTOGRAM_SUB - 1;
+		uint64_t value = (((uint64_t)(i - shift * HISTOGRAM_SUB) + 1) << shift) - 1;
+		return (value < h->max)? value : h->max;
+	}
+
+	return h->max;
+}
+
+/*
+ * Prints percentile rows of histogram in ns
+ *
+ * @param const char * name, const struct histogram * h
+ */
+void histogram_print(const char * name, const struct histogram * h)
+{
+	char label[64];
+	const double percentiles[] = {50, 99, 99.9};
+	const char * labels[] = {"p50", "p99", "p99.9"};
+
+	for (int i = 0; i < 3; ++i)
+	{
+		snprintf(label, sizeof(label), "%s %s (ns)", name, labels[i]);
+		printf("| %-25s | %16.1f |\n", label, timer_seconds(histogram_percentile(h, percentiles[i])) * 1000000000.0);
+	}
+
+	snprintf(label, sizeof(label), "%s max (ns)", name);
+	printf("| %-25s | %16.1f |\n", label, timer_seconds(h->max) * 1000000000.0);
+	snprintf(label, sizeof(label), "%s calls", name);
+	printf("| %-25s | %16llu |\n", label, (unsigned long long)h->total);
+}
+
+//Nodes of the epoch check, check holds ~id so a reused node is seen
+struct check_node
+{
+	size_t id;
+	size_t check;
+	char body[48];
+};
+
+struct check_node * check_slots[CHECK_SLOTS];
+size_t check_id = 0;
+int check_stop = 0;
+size_t check_errors = 0;
+
+/*
+ * Allocates an epoch check node with a new id
+ *
+ * @return struct check_node * node
+ */
+struct check_node * check_node_new(void)
+{
+	struct check_node * n = (struct check_node *)mem_alloc(sizeof(struct check_node));
+	if (n == NULL)
+	{
+		printf("ERROR: could not allocate check node.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	n->id = __atomic_add_fetch(&check_id, 1, __ATOMIC_RELAXED);
+	n->check = ~n->id;
+	return n;
+}
+
+/*
+ * Replaces random nodes and defers the old ones, new nodes reuse the memory freed
+ *
+ * @param void * data (seed)
+ * @return void * NULL
+ */
+void * check_epoch_writer(void * data)
+{
+	unsigned int r = (unsigned int)(uintptr_t)data;
+	for (int i = 0; i < CHECK_STEPS; ++i)
+	{
+		r = r * 1103515245 + 12345;
+		struct check_node * old = __atomic_exchange_n(&check_slots[(r >> 8) % CHECK_SLOTS], check_node_new(), __ATOMIC_ACQ_REL);
+		mem_free_deferred(old);
+	}
+
+	return NULL;
+}
+
+/*
+ * Reads random nodes in nested read sections until stopped, a node changing
+ * under a reader is an error
+ *
+ * @param void * data (seed)
+ * @return void * NULL
+ */
+void * check_epoch_reader(void * data)
+{
+	unsigned int r = (unsigned int)(uintptr_t)data;
+	while (!__atomic_load_n(&check_stop, __ATOMIC_RELAXED))
+	{
+		r = r * 1103515245 + 12345;
+		if (mem_epoch_enter() != 0 || mem_epoch_enter() != 0)
+		{
+			__atomic_add_fetch(&check_errors, 1, __ATOMIC_RELAXED);
+			return NULL;
+		}
+
+		mem_epoch_exit();
+		struct check_node * n = __atomic_load_n(&check_slots[(r >> 8) % CHECK_SLOTS], __ATOMIC_ACQUIRE);
+		size_t id = __atomic_load_n(&n->id, __ATOMIC_RELAXED);
+		for (int i = 0; i < 64; ++i)
+			if (__atomic_load_n(&n->id, __ATOMIC_RELAXED) != id || __atomic_load_n(&n->check, __ATOMIC_RELAXED) != ~id)
+			{
+				__atomic_add_fetch(&check_errors, 1, __ATOMIC_RELAXED);
+				break;
+			}
+
+		mem_epoch_exit();
+	}
+
+	return NULL;
+}
+
+/*
+ * Checks deferred frees, readers racing writers never see a node freed and a
+ * node deferred inside a read section is only reused after it
+ *
+ * @return unsigned int errors
+ */
+unsigned int check_epoch(void)
+{
+	for (int i = 0; i < CHECK_SLOTS; ++i)
+		check_slots[i] = check_node_new();
+
+	pthread_t readers[CHECK_THREADS], writers[CHECK_THREADS];
+	for (int i = 0; i < CHECK_THREADS; ++i)
+		if (pthread_create(&readers[i], NULL, check_epoch_reader, (void *)(uintptr_t)(i + 100)) != 0 ||
+		    pthread_create(&writers[i], NULL, check_epoch_writer, (void *)(uintptr_t)(i + 1)) != 0)
+		{
+			printf("ERROR: could not start check threads.\n");
 			exit(EXIT_FAILURE);
 		}
 
-		struct timespec ts_end;
-		if (timespec_get(&ts_end, TIME_UTC) == 0) {
-			printf("ERROR: Could not record resource usage.\n");
+	for (int i = 0; i < CHECK_THREADS; ++i)
+		pthread_join(writers[i], NULL);
+
+	__atomic_store_n(&check_stop, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < CHECK_THREADS; ++i)
+		pthread_join(readers[i], NULL);
+
+	unsigned int errors = (unsigned int)check_errors;
+
+	//Without readers the heap stays flat
+	struct mem_heap_stats before, after;
+	mem_epoch_reclaim();
+	mem_heap_stats_get(&before);
+	for (int i = 0; i < CHECK_STEPS; ++i)
+		mem_free_deferred(check_node_new());
+	mem_epoch_reclaim();
+	mem_heap_stats_get(&after);
+
+	if (after.heap_bytes > before.heap_bytes + 1024 * 1024)
+		errors++;
+
+	//Held by the open section
+	if (mem_epoch_enter() != 0)
+		return errors + 1;
+
+	struct check_node * n = check_node_new();
+	mem_free_deferred(n);
+	mem_epoch_reclaim();
+	struct check_node * m = check_node_new();
+	if (m == n)
+		errors++;
+
+	mem_epoch_exit();
+	mem_free(m);
+
+	for (int i = 0; i < CHECK_SLOTS; ++i)
+		mem_free_deferred(check_slots[i]);
+	mem_epoch_reclaim();
+
+	return errors;
+}
+
+/*
+ * Frees large and small blocks while keeping some, with flushes in between
+ *
+ * @param void * data (seed)
+ * @return void * NULL
+ */
+void * check_async_worker(void * data)
+{
+	unsigned int r = (unsigned int)(uintptr_t)data;
+	void * keep[CHECK_SLOTS] = {NULL};
+	for (int i = 0; i < CHECK_STEPS / 10; ++i)
+	{
+		r = r * 1103515245 + 12345;
+		unsigned int k = (r >> 8) % CHECK_SLOTS;
+		mem_free(keep[k]);
+
+		size_t size = ((r >> 16) % 4 == 0)? 200 * 1024 : 70 * 1024;
+		if ((r >> 20) % 3 == 0)
+			size = 100;
+
+		size += r % 4096;
+		keep[k] = mem_alloc(size);
+		if (keep[k] != NULL)
+		{
+			memset(keep[k], (int)k, 64);
+			((char *)keep[k])[size - 1] = 1;
+		}
+
+		if (i % 2000 == 0)
+			mem_free_flush();
+	}
+
+	for (int k = 0; k < CHECK_SLOTS; ++k)
+		mem_free(keep[k]);
+
+	return NULL;
+}
+
+/*
+ * Allocates and frees large blocks until stopped, so forks happen while other
+ * threads are inside the allocator
+ *
+ * @param void * data (unused)
+ * @return void * NULL
+ */
+void * check_async_churn(void * data)
+{
+	(void)data;
+	for (size_t i = 0; !__atomic_load_n(&check_stop, __ATOMIC_RELAXED); ++i)
+		mem_free(mem_alloc(70 * 1024 + (i % 100) * 1024));
+
+	return NULL;
+}
+
+/*
+ * Checks background frees, a flush waits for every free queued before it, a
+ * burst past async_limit does not grow the heap and a forked child frees what
+ * was queued in the parent and frees in the background again
+ *
+ * @return unsigned int errors
+ */
+unsigned int check_async(void)
+{
+	unsigned int errors = 0;
+	struct mem_heap_stats before, after;
+	mem_free_flush();
+	mem_heap_stats_get(&before);
+
+	pthread_t threads[CHECK_THREADS];
+	for (int i = 0; i < CHECK_THREADS; ++i)
+		if (pthread_create(&threads[i], NULL, check_async_worker, (void *)(uintptr_t)(i + 1)) != 0)
+		{
+			printf("ERROR: could not start check threads.\n");
+			exit(EXIT_FAILURE);
+		}
+
+	for (int i = 0; i < CHECK_THREADS; ++i)
+		pthread_join(threads[i], NULL);
+
+	mem_free_flush();
+	mem_heap_stats_get(&after);
+	if (after.used_bytes > before.used_bytes + 64 * 1024)
+		errors++;
+
+	//Backpressure
+	void * burst[100];
+	for (int i = 0; i < 100; ++i)
+		burst[i] = mem_alloc(300 * 1024);
+	for (int i = 0; i < 100; ++i)
+		mem_free(burst[i]);
+
+	mem_free_flush();
+	mem_heap_stats_get(&after);
+	if (after.used_bytes > before.used_bytes + 64 * 1024)
+		errors++;
+
+	#if defined(__linux) || defined(__unix)
+		__atomic_store_n(&check_stop, 0, __ATOMIC_RELAXED);
+		pthread_t churn;
+		if (pthread_create(&churn, NULL, check_async_churn, NULL) != 0)
+		{
+			printf("ERROR: could not start check threads.\n");
+			exit(EXIT_FAILURE);
+		}
+
+		for (int round = 0; round < CHECK_FORKS; ++round)
+		{
+			mem_free_flush();
+			mem_heap_stats_get(&before);
+
+			//Half is queued in the parent around the fork
+			void * blocks[16];
+			for (int i = 0; i < 16; ++i)
+				blocks[i] = mem_alloc(1024 * 1024);
+			for (int i = 0; i < 8; ++i)
+				mem_free(blocks[i]);
+
+			pid_t pid = fork();
+			if (pid == 0)
+			{
+				alarm(10);
+				for (int i = 8; i < 16; ++i)
+					mem_free(blocks[i]);
+				for (int i = 0; i < 100; ++i)
+					mem_free(mem_alloc(1024 * 1024));
+
+				//A block the churn thread had in hand at the fork is never freed here
+				mem_free_flush();
+				mem_heap_stats_get(&after);
+				_exit(after.used_blocks > before.used_blocks + 2);
+			}
+
+			int status = 0;
+			if (pid == -1 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+				errors++;
+
+			for (int i = 8; i < 16; ++i)
+				mem_free(blocks[i]);
+		}
+
+		__atomic_store_n(&check_stop, 1, __ATOMIC_RELAXED);
+		pthread_join(churn, NULL);
+		mem_free_flush();
+	#endif
+
+	return errors;
+}
+
+//Objects handed from a producer thread to a consumer thread, each fills its
+//object with its id so an object given out twice is seen
+struct check_ring
+{
+	void * slots[CHECK_RING];
+	size_t head; //Written by the producer
+	size_t tail; //Written by the consumer
+	size_t errors;
+};
+
+struct mem_objpool * check_pool = NULL;
+
+/*
+ * Allocates objects and frees them all, more than a magazine holds, then exits
+ * which leaves its magazines in the depot
+ *
+ * @param void * data (void ** objects, 2 * CHECK_MAGAZINE + 1)
+ * @return void * NULL
+ */
+void * check_objpool_fill(void * data)
+{
+	void ** objects = (void **)data;
+	for (int i = 0; i < 2 * CHECK_MAGAZINE + 1; ++i)
+		objects[i] = mem_objpool_alloc(check_pool);
+	for (int i = 0; i < 2 * CHECK_MAGAZINE + 1; ++i)
+		mem_objpool_free(check_pool, objects[i]);
+
+	return NULL;
+}
+
+/*
+ * Allocates objects and passes them on, the consumer frees them so the
+ * producer's magazine is refilled by swapping for full ones
+ *
+ * @param void * data (struct check_ring *)
+ * @return void * NULL
+ */
+void * check_objpool_producer(void * data)
+{
+	struct check_ring * ring = (struct check_ring *)data;
+	for (size_t id = 1; id <= CHECK_STEPS; ++id)
+	{
+		size_t * o = (size_t *)mem_objpool_alloc(check_pool);
+		if (o == NULL)
+			ring->errors++;
+		else
+			for (int i = 0; i < 8; ++i)
+				o[i] = id;
+
+		while (id - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > CHECK_RING)
+			sched_yield();
+
+		ring->slots[id % CHECK_RING] = o;
+		__atomic_store_n(&ring->head, id, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+/*
+ * Checks and frees the objects of a producer
+ *
+ * @param void * data (struct check_ring *)
+ * @return void * NULL
+ */
+void * check_objpool_consumer(void * data)
+{
+	struct check_ring * ring = (struct check_ring *)data;
+	for (size_t id = 1; id <= CHECK_STEPS; ++id)
+	{
+		while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) < id)
+			sched_yield();
+
+		size_t * o = (size_t *)ring->slots[id % CHECK_RING];
+		for (int i = 0; o != NULL && i < 8; ++i)
+			if (o[i] != id)
+			{
+				ring->errors++;
+				break;
+			}
+
+		mem_objpool_free(check_pool, o);
+		__atomic_store_n(&ring->tail, id, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+/*
+ * Checks objpool magazines, a thread with an empty magazine swaps it for one
+ * another thread filled, and objects moving between threads through the depot
+ * are never given out twice
+ *
+ * @return unsigned int errors
+ */
+unsigned int check_objpool(void)
+{
+	unsigned int errors = 0;
+	check_pool = mem_objpool_create(8 * sizeof(size_t), 0);
+	if (check_pool == NULL || mem_objpool_magazines(check_pool, CHECK_MAGAZINE) != 0)
+		return 1;
+
+	//First allocation of this thread takes a magazine the other thread filled
+	void * objects[2 * CHECK_MAGAZINE + 1];
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, check_objpool_fill, objects) != 0)
+	{
+		printf("ERROR: could not start check threads.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_join(thread, NULL);
+	void * o = mem_objpool_alloc(check_pool);
+	int found = 0;
+	for (int i = 0; i < 2 * CHECK_MAGAZINE + 1; ++i)
+		found |= o == objects[i];
+
+	errors += (found == 0);
+	mem_objpool_free(check_pool, o);
+
+	//Producers only allocate and consumers only free
+	struct check_ring rings[CHECK_THREADS / 2 + 1];
+	pthread_t producers[CHECK_THREADS / 2 + 1], consumers[CHECK_THREADS / 2 + 1];
+	for (int i = 0; i < CHECK_THREADS / 2 + 1; ++i)
+	{
+		memset(&rings[i], 0, sizeof(struct check_ring));
+		if (pthread_create(&producers[i], NULL, check_objpool_producer, &rings[i]) != 0 ||
+		    pthread_create(&consumers[i], NULL, check_objpool_consumer, &rings[i]) != 0)
+		{
+			printf("ERROR: could not start check threads.\n");
 			exit(EXIT_FAILURE);
 		}
+	}
+
+	for (int i = 0; i < CHECK_THREADS / 2 + 1; ++i)
+	{
+		pthread_join(producers[i], NULL);
+		pthread_join(consumers[i], NULL);
+		errors += (unsigned int)rings[i].errors;
+	}
+
+	mem_objpool_destroy(check_pool);
+	return errors;
+}
+
+//Node of the compressed arena check, linked by offsets
+struct check_compressed
+{
+	uint32_t next;
+	uint32_t id;
+};
+
+/*
+ * Builds a list linked by 32-bit offsets in a compressed arena
+ *
+ * @param struct mem_arena * a, uint32_t * last (highest offset seen)
+ * @return uint32_t first node, 0 if fail
+ */
+uint32_t check_compressed_build(struct mem_arena * a, uint32_t * last)
+{
+	uint32_t first = 0;
+	for (uint32_t id = 1; id <= CHECK_STEPS / 10; ++id)
+	{
+		uint32_t offset = mem_compressed_alloc(a, sizeof(struct check_compressed) + id % 200);
+		struct check_compressed * n = (struct check_compressed *)mem_decompress(a, offset);
+		if (n == NULL)
+			return 0;
+
+		n->next = first;
+		n->id = id;
+		first = offset;
+		if (offset > *last)
+			*last = offset;
+	}
+
+	return first;
+}
+
+/*
+ * Checks compressed arenas, offsets round trip to aligned addresses, a list
+ * linked by offsets reads back and freed blocks are used again
+ *
+ * @return unsigned int errors
+ */
+unsigned int check_compressed(void)
+{
+	unsigned int errors = 0;
+	struct mem_arena * a = mem_compressed_open(64 * 1024 * 1024);
+	if (a == NULL)
+		return 1;
+
+	//Second round must fit below the highest offset of the first
+	uint32_t limit = 0;
+	for (int round = 0; round < 2; ++round)
+	{
+		uint32_t last = 0;
+		uint32_t offset = check_compressed_build(a, (round == 0)? &limit : &last);
+		if (offset == 0 || (round == 1 && last > limit))
+			errors++;
+
+		for (uint32_t id = CHECK_STEPS / 10; offset != 0; --id)
+		{
+			struct check_compressed * n = (struct check_compressed *)mem_decompress(a, offset);
+			if (n->id != id || mem_compress(a, n) != offset || ((uintptr_t)n & ((1 << MEM_COMPRESSED_SHIFT) - 1)) != 0)
+				errors++;
+
+			offset = n->next;
+			if (round == 0)
+				mem_compressed_free(a, mem_compress(a, n));
+			else
+				mem_free(n);
+		}
+	}
+
+	if (mem_compressed_close(a) != 0)
+		errors++;
+
+	return errors;
+}
+
+/*
+ * Checks calloc, sizes that overflow or do not fit a block fail and memory
+ * reused from dirty frees or taken from fresh pages is zero
+ *
+ * @return unsigned int errors
+ */
+unsigned int check_calloc(void)
+{
+	unsigned int errors = 0;
+	const size_t overflow[][2] = {
+		{1, SIZE_MAX}, {1, SIZE_MAX - 3}, {SIZE_MAX / 2, 3}, {2, SIZE_MAX / 2 + 1}, {1, SIZE_MAX >> 6}
+	};
+
+	for (size_t i = 0; i < sizeof(overflow) / sizeof(overflow[0]); ++i)
+	{
+		void * p = mem_calloc(overflow[i][0], overflow[i][1]);
+		if (p != NULL)
+		{
+			errors++;
+			mem_free(p);
+		}
+	}
+
+	//Small sizes come back from the dirty block just freed, large ones from fresh pages
+	const size_t sizes[] = {1, 24, 100, 4096, 100000, 2 * 1024 * 1024 + 3};
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+	{
+		unsigned char * p = (unsigned char *)mem_alloc(sizes[i]);
+		if (p == NULL)
+			return errors + 1;
+
+		memset(p, 0xA5, sizes[i]);
+		mem_free(p);
+
+		p = (unsigned char *)mem_calloc(1, sizes[i]);
+		if (p == NULL || mem_usable_size(p) < sizes[i])
+			return errors + 1;
+
+		for (size_t k = 0; k < sizes[i]; ++k)
+			if (p[k] != 0)
+			{
+				errors++;
+				break;
+			}
+
+		mem_free(p);
+	}
+
+	return errors;
+}
+
+//Node of the persistent arena check, linked by pointers that hold across runs
+struct check_persist
+{
+	struct check_persist * next;
+	size_t id;
+};
+
+/*
+ * Adds nodes from to last to the front of a list in a persistent arena
+ *
+ * @param struct mem_arena * a, struct check_persist * list, size_t from, size_t last
+ * @return struct check_persist * list, NULL if fail
+ */
+struct check_persist * check_persist_build(struct mem_arena * a, struct check_persist * list, size_t from, size_t last)
+{
+	for (size_t id = from; id <= last; ++id)
+	{
+		struct check_persist * n = (struct check_persist *)mem_arena_alloc(a, sizeof(struct check_persist) + id % 100);
+		if (n == NULL)
+			return NULL;
 
-		uncertainty += time_to_double(ts_end) - time_to_double(ts_start);
+		n->next = list;
+		n->id = id;
+		list = n;
 	}
 
-	return uncertainty / UNCERTAINTY_STEPS;
+	return list;
+}
+
+/*
+ * Checks persistent arenas, a list and root survive a clean close and reopen,
+ * and nodes added by a process that exited without closing are found again
+ * once the dirty region is rebuilt
+ *
+ * @return unsigned int errors
+ */
+unsigned int check_persist(void)
+{
+	unsigned int errors = 0;
+	char path[64];
+	snprintf(path, sizeof(path), "check_%d.persist", (int)getpid());
+	unlink(path);
+
+	struct mem_arena * a = mem_persist_open(path, NULL, CHECK_REGION);
+	if (a == NULL)
+		return 1;
+
+	struct check_persist * list = check_persist_build(a, NULL, 1, CHECK_NODES);
+	errors += (list == NULL);
+	mem_persist_root_set(a, list);
+	errors += (mem_persist_close(a) != 0);
+
+	#if defined(__linux) || defined(__unix)
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			alarm(10);
+			a = mem_persist_open(path, NULL, 0);
+			if (a == NULL || (list = check_persist_build(a, (struct check_persist *)mem_persist_root_get(a), CHECK_NODES + 1, 2 * CHECK_NODES)) == NULL)
+				_exit(1);
+
+			mem_persist_root_set(a, list);
+			_exit(0);
+		}
+
+		int status = 0;
+		if (pid == -1 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			errors++;
+
+		size_t count = 2 * CHECK_NODES;
+	#else
+		size_t count = CHECK_NODES;
+	#endif
+
+	a = mem_persist_open(path, NULL, 0);
+	if (a == NULL)
+	{
+		unlink(path);
+		return errors + 1;
+	}
+
+	size_t id = count;
+	for (list = (struct check_persist *)mem_persist_root_get(a); list != NULL && list->id == id; list = list->next)
+		id--;
+
+	if (list != NULL || id != 0)
+	{
+		mem_persist_close(a);
+		unlink(path);
+		return errors + 1;
+	}
+
+	//Rebuilt pools take the nodes back and hand them out again
+	list = (struct check_persist *)mem_persist_root_get(a);
+	while (list != NULL)
+	{
+		struct check_persist * next = list->next;
+		mem_free(list);
+		list = next;
+	}
+
+	list = check_persist_build(a, NULL, 1, count);
+	errors += (list == NULL);
+	mem_persist_root_set(a, list);
+	errors += (mem_persist_close(a) != 0);
+
+	unlink(path);
+	return errors;
+}
+
+/*
+ * Checks shared arenas, a child attaches by fd, reads a block by offset, frees
+ * it and hands back a block of its own, the parent then reuses the freed block
+ *
+ * @return unsigned int errors
+ */
+unsigned int check_shared(void)
+{
+	#if defined(__linux) || defined(__unix)
+		unsigned int errors = 0;
+		struct mem_arena * a = mem_shared_open(NULL, CHECK_REGION);
+		if (a == NULL)
+			return 1;
+
+		size_t * block = (size_t *)mem_arena_alloc(a, 256);
+		size_t * mailbox = (size_t *)mem_arena_alloc(a, sizeof(size_t));
+		if (block == NULL || mailbox == NULL)
+			return 1;
+
+		block[0] = 12345;
+		*mailbox = 0;
+		size_t offset = mem_shared_offset(a, block);
+
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			alarm(10);
+			struct mem_arena * b = mem_shared_attach(dup(mem_shared_fd(a)));
+			size_t * shared = (b == NULL)? NULL : (size_t *)mem_shared_pointer(b, offset);
+			size_t * own = (b == NULL)? NULL : (size_t *)mem_arena_alloc(b, 64);
+			if (shared == NULL || shared[0] != 12345 || own == NULL)
+				_exit(1);
+
+			own[0] = 54321;
+			*(size_t *)mem_shared_pointer(b, mem_shared_offset(a, mailbox)) = mem_shared_offset(b, own);
+			mem_free(shared);
+			_exit(mem_shared_close(b) != 0);
+		}
+
+		int status = 0;
+		if (pid == -1 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			errors++;
+
+		size_t * own = (size_t *)mem_shared_pointer(a, *mailbox);
+		errors += (own == NULL || own[0] != 54321);
+
+		size_t * again = (size_t *)mem_arena_alloc(a, 256);
+		errors += (again != block);
+
+		mem_free(own);
+		mem_free(again);
+		mem_free(mailbox);
+		errors += (mem_shared_close(a) != 0);
+		return errors;
+	#else
+		return 0;
+	#endif
+}
+
+/*
+ * Prints a check row
+ *
+ * @param const char * name, unsigned int errors
+ */
+void check_print(const char * name, unsigned int errors)
+{
+	char result[32];
+	snprintf(result, sizeof(result), (errors == 0)? "ok" : "%u errors", errors);
+	printf("| %-25s | %16s |\n", name, result);
+}
+
+/*
+ * Runs the allocator checks
+ *
+ * @return int EXIT_SUCCESS if all passed
+ */
+int check_run(void)
+{
+	unsigned int fails = 0;
+	unsigned int errors;
+
+	if (mem_config(CHECK_CONF) != 0)
+	{
+		printf("ERROR: could not configure allocator.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Checks\n+");
+	for (int i = 0; i < 46; ++i)
+		putchar('-');
+	printf("+\n");
+
+	errors = check_epoch();
+	check_print("Epoch readers/writers", errors);
+	fails += (errors != 0);
+
+	errors = check_async();
+	check_print("Async flush/fork", errors);
+	fails += (errors != 0);
+
+	errors = check_objpool();
+	check_print("Objpool magazine swap", errors);
+	fails += (errors != 0);
+
+	errors = check_compressed();
+	check_print("Compressed arena offsets", errors);
+	fails += (errors != 0);
+
+	errors = check_persist();
+	check_print("Persistent arena reopen", errors);
+	fails += (errors != 0);
+
+	errors = check_shared();
+	check_print("Shared arena attach/free", errors);
+	fails += (errors != 0);
+
+	errors = check_calloc();
+	check_print("Calloc overflow/zeroing", errors);
+	fails += (errors != 0);
+
+	putchar('+');
+	for (int i = 0; i < 46; ++i)
+		putchar('-');
+	printf("+\n");
+
+	return (fails == 0)? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 int main(int argc, char **argv)
 {
+	//Allocator checks instead of the timing run
+	if (argc > 1 && strcmp(argv[1], "check") == 0)
+		return check_run();
+
 	double time_average_malloc = 0;
 	double time_average_free = 0;
+	double time_average_realloc = 0;
 	double memory_average_alloc = 0;
 	unsigned int fails = 0;
 
@@ -96,6 +1137,34 @@ int main(int argc, char **argv)
 	#endif
 
 	srand(SEED);
+	timer_calibrate();
+
+	//Each allocator runs in its own process
+	#ifdef WORKLOAD_COMPARE
+		FILE * out = fopen(WORKLOAD_COMPARE, "w");
+		if (out == NULL)
+		{
+			printf("ERROR: could not open compare file.\n");
+			exit(EXIT_FAILURE);
+		}
+
+		const char * extension = strrchr(WORKLOAD_COMPARE, '.');
+		enum workload_format format = (extension != NULL && strcmp(extension, ".json") == 0)? WORKLOAD_JSON : WORKLOAD_CSV;
+		int result = workload_compare(allocators, sizeof(allocators) / sizeof(allocators[0]), &workload_config, format, out);
+		fclose(out);
+
+		printf("Workload comparison written to %s\n", WORKLOAD_COMPARE);
+		return (result == 0)? EXIT_SUCCESS : EXIT_FAILURE;
+	#endif
+
+	#ifdef WORKLOAD
+		struct workload workload;
+		if (workload_init(&workload, &workload_config) != 0)
+		{
+			printf("ERROR: could not set up workload.\n");
+			exit(EXIT_FAILURE);
+		}
+	#endif
 
 	//Open dump file
 	#ifdef FILE_DUMP
@@ -110,7 +1179,7 @@ int main(int argc, char **argv)
 		}
 
 		//Setup csv
-		fprintf(fp, "Iteration,Pointer Address (Dec),Allocation Size (dec),Time Taken (ns),Space Used (bytes),Status\n");
+		fprintf(fp, "Iteration,Pointer Address (Dec),Allocation Size (dec),Time Taken (ns),Space Used (bytes),Status,Call\n");
 	#endif
 
 	//Clear all pointers
@@ -119,15 +1188,25 @@ int main(int argc, char **argv)
 
 	//Record resources for start
 	#if defined(__linux) || defined(__unix)
-		unsigned int memory_start = (unsigned int)sbrk(0);
+		intptr_t memory_start = (intptr_t)sbrk(0);
 	#endif
 
 	clock_t time_start = clock();
 
 	for (int i = 0; i < STEPS; ++i)
 	{
-		struct timespec ts_start, ts_end;
+		uint64_t t_start, t_end, t = 0;
+
 		//Generate numbers
+		#ifdef WORKLOAD
+		struct workload_op op;
+		if (!workload_next(&workload, &op))
+			break;
+
+		size_t size = op.size;
+		unsigned int index = (unsigned int)op.slot;
+		enum workload_call call = op.call;
+		#else
 		#ifdef SIZE_ALLOC_FIXED
 		unsigned int size = SIZE_ALLOC_FIXED;
 		#else
@@ -135,70 +1214,78 @@ int main(int argc, char **argv)
 		#endif
 
 		unsigned int index = (unsigned int)rand() % POINTER_NUMBER;
+		enum workload_call call = (pointers[index].addr != NULL && (unsigned int)rand() % 100 < REALLOC_PERCENT)? WORKLOAD_REALLOC : WORKLOAD_MALLOC;
+		#endif
 
 		//Record mem
 		#if defined(__linux) || defined(__unix)
-		unsigned int m_start = (unsigned int)sbrk(0);
+		intptr_t m_start = (intptr_t)sbrk(0);
 		#endif
 
-		//Record time
-		if (timespec_get(&ts_start, TIME_UTC) == 0)
+		if (call == WORKLOAD_REALLOC)
 		{
-			printf("ERROR: Could not record resource usage.\n");
-			exit(EXIT_FAILURE);
-		}
+			//test realloc
+			t_start = timer_now();
+			void * addr = __realloc(pointers[index].addr, size);
+			t_end = timer_now();
 
-		//test free
-		if (pointers[index].addr == NULL)
-			__free(pointers[index].addr);
+			t = timer_elapsed(t_start, t_end);
+			histogram_record(&histogram_realloc, t);
+			time_average_realloc += timer_seconds(t);
 
-		if (timespec_get(&ts_end, TIME_UTC) == 0)
-		{
-			printf("ERROR: Could not record resource usage.\n");
-			exit(EXIT_FAILURE);
+			//Old pointer is still held if realloc failed
+			if (addr != NULL)
+				pointers[index].addr = addr;
 		}
-
-		time_average_free += time_to_double(ts_end) - time_to_double(ts_start);
-
-		//Record time
-		if (timespec_get(&ts_start, TIME_UTC) == 0)
+		else
 		{
-			printf("ERROR: Could not record resource usage.\n");
-			exit(EXIT_FAILURE);
-		}
+			//test free
+			if (pointers[index].addr != NULL)
+			{
+				t_start = timer_now();
+				__free(pointers[index].addr);
+				t_end = timer_now();
 
-		//test malloc
-		pointers[index].addr = __malloc(size);
+				t = timer_elapsed(t_start, t_end);
+				histogram_record(&histogram_free, t);
+				time_average_free += timer_seconds(t);
+				pointers[index].addr = NULL;
+			}
 
-		if (timespec_get(&ts_end, TIME_UTC) == 0)
-		{
-			printf("ERROR: Could not record resource usage.\n");
-			exit(EXIT_FAILURE);
-		}
+			//test malloc
+			if (call == WORKLOAD_MALLOC)
+			{
+				t_start = timer_now();
+				pointers[index].addr = __malloc(size);
+				t_end = timer_now();
 
+				t = timer_elapsed(t_start, t_end);
+				histogram_record(&histogram_malloc, t);
+				time_average_malloc += timer_seconds(t);
+			}
+		}
 
 		#if defined(__linux) || defined(__unix)
-		unsigned int m_end = (unsigned int)sbrk(0);
+		intptr_t m_end = (intptr_t)sbrk(0);
 		#endif
 
-		if (pointers[index].addr == NULL)
+		if (call != WORKLOAD_FREE && pointers[index].addr == NULL)
 			fails++;
 
 		//Record size
 		pointers[index].size = size;
-
-		time_average_malloc += time_to_double(ts_end) - time_to_double(ts_start);
 		memory_average_alloc += size;
 
 		//Record data to dump file
 		#ifdef FILE_DUMP
-			fprintf(fp, "%d,%llu,%d,%e,%d,%s\n",
+			fprintf(fp, "%d,%llu,%d,%.1f,%lld,%s,%s\n",
 			        i + 1,
-			        (long long int)pointers[index].addr,
+			        (unsigned long long)(uintptr_t)pointers[index].addr,
 					(int)size,
-					time_to_double(ts_end) - time_to_double(ts_start),
-					(int)m_end - (int)m_start,
-					(pointers[index].addr == NULL)?"Fail":"Success");
+					timer_seconds(t) * 1000000000.0,
+					(long long)(m_end - m_start),
+					(call != WORKLOAD_FREE && pointers[index].addr == NULL)?"Fail":"Success",
+					call_names[call]);
 		#endif
 	}
 
@@ -207,11 +1294,15 @@ int main(int argc, char **argv)
 		fclose(fp);
 	#endif
 
+	#ifdef WORKLOAD
+		workload_destroy(&workload);
+	#endif
+
 	//Record resources for end
 	clock_t time_end = clock();
 
 	#if defined(__linux) || defined(__unix)
-	unsigned int memory_end = (unsigned int)sbrk(0);
+	intptr_t memory_end = (intptr_t)sbrk(0);
 	#endif
 
 	//Print results
@@ -245,8 +1336,23 @@ int main(int argc, char **argv)
 	printf("| %-25s | %8d/1000000 |\n", "CLOCKS_PER_SEC", (int)CLOCKS_PER_SEC);
 	printf("| %-25s | %16e |\n", "Average malloc time", time_average_malloc / STEPS);
 	printf("| %-25s | %16e |\n", "Average free time", time_average_free / STEPS);
+	printf("| %-25s | %16e |\n", "Average realloc time", time_average_realloc / STEPS);
 	printf("| %-25s | %16e |\n", "Uncertainty (+-)", uncertainty_get() / STEPS);
 	printf("| %-25s | %16d |\n", "Uncertainty steps", UNCERTAINTY_STEPS);
+	printf("| %-25s | %16.1f |\n", "Timer overhead (ns)", timer_seconds(timer_overhead) * 1000000000.0);
+	#ifdef TIMER_TSC
+	printf("| %-25s | %16.3f |\n", "Timer ticks per ns", timer_rate);
+	#endif
+
+	//Latency percentiles
+	printf("|");
+	for (int i = 0; i < 46; ++i)
+		putchar('-');
+	printf("|\n");
+
+	histogram_print("malloc", &histogram_malloc);
+	histogram_print("free", &histogram_free);
+	histogram_print("realloc", &histogram_realloc);
 
 	//Memory used
 	printf("|");
@@ -255,7 +1361,7 @@ int main(int argc, char **argv)
 	printf("|\n");
 
 	#if defined(__linux) || defined(__unix)
-	printf("| %-25s | %16d |\n", "Memory used (sbrk)", memory_end - memory_start);
+	printf("| %-25s | %16lld |\n", "Memory used (sbrk)", (long long)(memory_end - memory_start));
 	#endif
 
 	printf("| %-25s | %16lf |\n", "Average memory allocated", memory_average_alloc / STEPS);
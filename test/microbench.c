@@ -0,0 +1,380 @@
+/* General Purpose Memory Allocator (gpmalloc)
+ * microbench.c
+ *
+ * Copyright (C) 2018
+ * All Rights Reserved
+ */
+
+//Internal functions are benchmarked, so the allocator is built into this file
+#ifndef NO_DEBUG_MAIN
+	#define NO_DEBUG_MAIN
+#endif
+#include "../gpmalloc.c"
+
+#include <stdio.h>
+#include <math.h>
+
+//Options
+#define SAMPLES 30 //Timed samples per benchmark, after one warm up
+#define SAMPLE_TIME 0.002 //Least seconds per sample, ops per sample are doubled until reached
+#define SAMPLE_OPS_MAX (1 << 24)
+#define T_95 2.045 //Student t for 95% confidence at SAMPLES - 1 degrees of freedom
+#define SEED 1234
+
+//Free blocks sit in the pool for sizes > TABLE_SIZE, the only pool holding many sizes
+#define POOL_SIZE_MIN (TABLE_SIZE + 8)
+#define POOL_SIZE_STEPS 4096 //Sizes are POOL_SIZE_MIN + 8 * [0, POOL_SIZE_STEPS)
+#define BLOCK_STRIDE 64 //Pool benchmarks only touch headers and pool links, blocks claim sizes they do not have
+#define PROBE_BLOCKS 1024 //Blocks inserted and sizes searched, cycled through
+
+//block_split and block_join use real blocks of SPLIT_SMALL and a rest. block_split leaves a rest
+//of random size, block_join one of the smallest size so the untimed split is not sorted far
+#define SPLIT_BLOCKS 256
+#define SPLIT_SMALL 64
+#define SPLIT_SIZE (SPLIT_SMALL + sizeof(struct block) + POOL_SIZE_MIN + 8 * POOL_SIZE_STEPS)
+
+//Free blocks already in the pool
+const size_t occupancies[] = {0, 10, 1000, 100000};
+
+struct fixture
+{
+	struct mem_arena * a;
+	size_t occupancy;
+	uint64_t random;
+
+	void * background; //occupancy blocks, in the pool
+	void * probes; //PROBE_BLOCKS blocks, not in the pool
+	size_t sizes[PROBE_BLOCKS];
+	size_t next;
+
+	void * real; //SPLIT_BLOCKS blocks, SPLIT_SIZE apart
+	struct block_free * split[SPLIT_BLOCKS];
+};
+
+struct benchmark
+{
+	const char * name;
+	bool occupied; //Run once per occupancy
+	double (*run)(struct fixture *, size_t); //ns for ops operations
+};
+
+struct mem_arena bench_arena;
+volatile size_t sink;
+
+/*
+ * Current time in ns
+ *
+ * @return double ns
+ */
+double time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1000000000.0 + (double)ts.tv_nsec;
+}
+
+/*
+ * xorshift64
+ *
+ * @param uint64_t * state
+ * @return uint64_t
+ */
+uint64_t random_next(uint64_t * state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+/*
+ * Size of a block in the pool
+ *
+ * @param struct fixture * f
+ * @return size_t size
+ */
+size_t pool_size_random(struct fixture * f)
+{
+	return POOL_SIZE_MIN + 8 * (size_t)(random_next(&f->random) % POOL_SIZE_STEPS);
+}
+
+/*
+ * Writes a free block header, not linked to neighbours
+ *
+ * @param void * address, size_t size
+ * @return struct block_free *
+ */
+struct block_free * block_fake(void * address, size_t size)
+{
+	struct block_free * b = (struct block_free *)address;
+	b->size = 0;
+	SIZE_SET(b->size, size);
+	LINK_SET(b->block_prev, NULL);
+	LINK_SET(b->block_next, NULL);
+	LINK_SET(b->pool_prev, NULL);
+	LINK_SET(b->pool_next, NULL);
+	return b;
+}
+
+/*
+ * Empties the arena and fills the pool with occupancy free blocks. Blocks are
+ * inserted largest first so each insert stops at the start of the list.
+ *
+ * @param struct fixture * f, size_t occupancy
+ */
+void fixture_fill(struct fixture * f, size_t occupancy)
+{
+	f->a = &bench_arena;
+	f->a->kind = ARENA_HEAP;
+	f->a->fast_max = 0;
+	arena_setup(f->a);
+	f->occupancy = occupancy;
+	f->random = SEED;
+
+	size_t * sizes = (size_t *)malloc((occupancy + 1) * sizeof(size_t));
+	for (size_t i = 0; i < occupancy; ++i)
+		sizes[i] = pool_size_random(f);
+
+	//Counting sort by size step, descending
+	size_t counts[POOL_SIZE_STEPS] = {0};
+	for (size_t i = 0; i < occupancy; ++i)
+		counts[(sizes[i] - POOL_SIZE_MIN) / 8]++;
+
+	size_t n = 0;
+	for (size_t step = POOL_SIZE_STEPS; step > 0; --step)
+		for (size_t c = 0; c < counts[step - 1]; ++c)
+			pool_insert(f->a, block_fake(f->background + n++ * BLOCK_STRIDE, POOL_SIZE_MIN + 8 * (step - 1)));
+
+	free(sizes);
+
+	for (size_t i = 0; i < PROBE_BLOCKS; ++i)
+		f->sizes[i] = pool_size_random(f);
+	f->next = 0;
+}
+
+/*
+ * Makes the real blocks free blocks of SPLIT_SMALL and a rest
+ *
+ * @param struct fixture * f, size_t count, bool random (rest of random size, else the smallest)
+ */
+void fixture_split_blocks(struct fixture * f, size_t count, bool random)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		size_t rest = (random)? f->sizes[f->next++ % PROBE_BLOCKS] : POOL_SIZE_MIN;
+		f->split[i] = block_fake(f->real + i * (SPLIT_SIZE + sizeof(struct block)), SPLIT_SMALL + sizeof(struct block) + rest);
+	}
+}
+
+/*
+ * table_index_get over every size up to TABLE_SIZE and some above
+ */
+double bench_table_index(struct fixture * f, size_t ops)
+{
+	(void)f;
+	size_t sum = 0;
+	double start = time_ns();
+	for (size_t i = 0; i < ops; ++i)
+		sum += table_index_get(i % (TABLE_SIZE + 256));
+	double end = time_ns();
+
+	sink = sum;
+	return end - start;
+}
+
+/*
+ * pool_insert of a block of random size, sorted into place by pool_sort, then
+ * pool_remove so the occupancy stays the same
+ */
+double bench_pool_insert(struct fixture * f, size_t ops)
+{
+	double start = time_ns();
+	for (size_t i = 0; i < ops; ++i)
+	{
+		size_t k = f->next++ % PROBE_BLOCKS;
+		struct block_free * b = block_fake(f->probes + k * BLOCK_STRIDE, f->sizes[k]);
+		pool_insert(f->a, b);
+		pool_remove(f->a, b);
+	}
+
+	return time_ns() - start;
+}
+
+/*
+ * pool_search for a random size, the block found stays in the pool
+ */
+double bench_pool_search(struct fixture * f, size_t ops)
+{
+	struct pool * p = &f->a->table[CLASS_MAX];
+	size_t found = 0;
+
+	double start = time_ns();
+	for (size_t i = 0; i < ops; ++i)
+		found += pool_search(f->sizes[f->next++ % PROBE_BLOCKS], p) != NULL;
+	double end = time_ns();
+
+	sink = found;
+	return end - start;
+}
+
+/*
+ * block_split of SPLIT_SMALL bytes from a free block, the rest of random size
+ * is sorted into the pool. Blocks are joined again untimed.
+ */
+double bench_block_split(struct fixture * f, size_t ops)
+{
+	double total = 0;
+	while (ops > 0)
+	{
+		size_t batch = (ops < SPLIT_BLOCKS)? ops : SPLIT_BLOCKS;
+		fixture_split_blocks(f, batch, true);
+
+		double start = time_ns();
+		for (size_t i = 0; i < batch; ++i)
+			block_split(f->a, SPLIT_SMALL, f->split[i]);
+		total += time_ns() - start;
+
+		for (size_t i = 0; i < batch; ++i)
+		{
+			SIZE_STATE_SET(f->split[i]->size, 0);
+			block_join(f->a, f->split[i]);
+		}
+
+		ops -= batch;
+	}
+
+	return total;
+}
+
+/*
+ * block_join of a freed block with the rest of its split, taken out of the
+ * pool. Blocks are split untimed.
+ */
+double bench_block_join(struct fixture * f, size_t ops)
+{
+	double total = 0;
+	while (ops > 0)
+	{
+		size_t batch = (ops < SPLIT_BLOCKS)? ops : SPLIT_BLOCKS;
+		fixture_split_blocks(f, batch, false);
+
+		for (size_t i = 0; i < batch; ++i)
+		{
+			block_split(f->a, SPLIT_SMALL, f->split[i]);
+			SIZE_STATE_SET(f->split[i]->size, 0);
+		}
+
+		double start = time_ns();
+		for (size_t i = 0; i < batch; ++i)
+			block_join(f->a, f->split[i]);
+		total += time_ns() - start;
+
+		ops -= batch;
+	}
+
+	return total;
+}
+
+/*
+ * page_get of one page, given back with page_free
+ */
+double bench_page_get(struct fixture * f, size_t ops)
+{
+	(void)f;
+	size_t page = page_size_get();
+	size_t failed = 0;
+
+	double start = time_ns();
+	for (size_t i = 0; i < ops; ++i)
+	{
+		void * addr = page_get(page);
+		failed += (addr == PAGE_FAIL || page_free(addr, page) != 0);
+	}
+	double end = time_ns();
+
+	sink = failed;
+	return end - start;
+}
+
+const struct benchmark benchmarks[] = {
+	{"table_index_get", false, bench_table_index},
+	{"pool_insert+remove", true, bench_pool_insert},
+	{"pool_search", true, bench_pool_search},
+	{"block_split", true, bench_block_split},
+	{"block_join", true, bench_block_join},
+	{"page_get", false, bench_page_get}
+};
+
+/*
+ * Runs a benchmark and prints ns/op with its 95% confidence interval
+ *
+ * @param const struct benchmark * b, struct fixture * f
+ */
+void bench_report(const struct benchmark * b, struct fixture * f)
+{
+	//Ops per sample, doubled until a sample takes SAMPLE_TIME
+	size_t ops = 1;
+	while (ops < SAMPLE_OPS_MAX && b->run(f, ops) < SAMPLE_TIME * 1000000000.0)
+		ops *= 2;
+
+	double samples[SAMPLES];
+	double mean = 0;
+	for (int i = 0; i < SAMPLES; ++i)
+	{
+		samples[i] = b->run(f, ops) / (double)ops;
+		mean += samples[i];
+	}
+	mean /= SAMPLES;
+
+	double variance = 0;
+	for (int i = 0; i < SAMPLES; ++i)
+		variance += (samples[i] - mean) * (samples[i] - mean);
+	variance /= SAMPLES - 1;
+
+	double ci = T_95 * sqrt(variance / SAMPLES);
+	if (b->occupied)
+		printf("%-18s %10zu %12.2f %10.2f %10zu\n", b->name, f->occupancy, mean, ci, ops);
+	else
+		printf("%-18s %10s %12.2f %10.2f %10zu\n", b->name, "-", mean, ci, ops);
+}
+
+int main(int argc, char **argv)
+{
+	//Setup allocator, the benchmarks use their own arena
+	mem_init();
+
+	const char * only = (argc > 1)? argv[1] : NULL;
+	size_t occupancy_max = occupancies[sizeof(occupancies) / sizeof(occupancies[0]) - 1];
+
+	struct fixture * f = (struct fixture *)malloc(sizeof(struct fixture));
+	f->background = page_map(occupancy_max * BLOCK_STRIDE);
+	f->probes = page_map(PROBE_BLOCKS * BLOCK_STRIDE);
+	f->real = page_map(SPLIT_BLOCKS * (SPLIT_SIZE + sizeof(struct block)));
+	if (f->background == PAGE_FAIL || f->probes == PAGE_FAIL || f->real == PAGE_FAIL)
+	{
+		printf("ERROR: Could not map benchmark memory.\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("%-18s %10s %12s %10s %10s\n", "benchmark", "occupancy", "ns/op", "+-95%", "ops/sample");
+	for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); ++i)
+	{
+		const struct benchmark * b = &benchmarks[i];
+		if (only != NULL && strncmp(only, b->name, strlen(only)) != 0)
+			continue;
+
+		size_t count = (b->occupied)? sizeof(occupancies) / sizeof(occupancies[0]) : 1;
+		for (size_t k = 0; k < count; ++k)
+		{
+			fixture_fill(f, occupancies[k]);
+			bench_report(b, f);
+		}
+	}
+
+	page_unmap(f->real, SPLIT_BLOCKS * (SPLIT_SIZE + sizeof(struct block)));
+	page_unmap(f->probes, PROBE_BLOCKS * BLOCK_STRIDE);
+	page_unmap(f->background, occupancy_max * BLOCK_STRIDE);
+	free(f);
+	return 0;
+}
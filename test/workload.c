@@ -0,0 +1,544 @@
+/* General Purpose Memory Allocator (gpmalloc)
+ * workload.c
+ *
+ * Copyright (C) 2018
+ * All Rights Reserved
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#if defined(__linux) || defined(__unix)
+	#include <unistd.h>
+	#include <fcntl.h>
+	#include <sys/wait.h>
+#endif
+
+#include "workload.h"
+
+//Options
+#define LIFETIME_SHORT 16 //Mean operations a short lived object lives
+#define LIFETIME_OLD 16384 //Mean operations a surviving generational object lives
+#define GENERATION_SURVIVE 10 //Percent of generational objects that survive
+#define REALLOC_SIZE_MAX (16 * 1024 * 1024)
+#define PAGE_TOUCH 4096 //Bytes between writes so allocated pages count in rss
+#define SAMPLE_MAX 4096
+
+/*
+ * Next random number, xorshift64*
+ *
+ * @param struct workload * w
+ * @return uint64_t
+ */
+uint64_t workload_random(struct workload * w)
+{
+	w->random ^= w->random >> 12;
+	w->random ^= w->random << 25;
+	w->random ^= w->random >> 27;
+	return w->random * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * Random number in (0, 1]
+ *
+ * @param struct workload * w
+ * @return double
+ */
+double workload_unit(struct workload * w)
+{
+	return (double)((workload_random(w) >> 11) + 1) / 9007199254740992.0;
+}
+
+/*
+ * Random number from min to max
+ *
+ * @param struct workload * w, size_t min, size_t max
+ * @return size_t
+ */
+size_t workload_range(struct workload * w, size_t min, size_t max)
+{
+	if (max <= min)
+		return min;
+
+	return min + (size_t)(workload_random(w) % (max - min + 1));
+}
+
+/*
+ * Draws allocation size for phase
+ *
+ * @param struct workload * w, const struct workload_phase * p
+ * @return size_t size > 0
+ */
+size_t workload_size_get(struct workload * w, const struct workload_phase * p)
+{
+	size_t size;
+	unsigned int r = (unsigned int)(workload_random(w) % 100);
+
+	switch (p->size)
+	{
+		case WORKLOAD_SIZE_POWER_LAW:
+			size = (size_t)((double)p->size_min * pow(workload_unit(w), -1.0 / ((p->alpha > 0)? p->alpha : 1.0)));
+			break;
+
+		case WORKLOAD_SIZE_BIMODAL:
+			if (r < 90)
+				size = workload_range(w, p->size_min, p->size_min * 4);
+			else
+				size = workload_range(w, p->size_max / 2, p->size_max);
+			break;
+
+		case WORKLOAD_SIZE_REDIS:
+			//Keys and sds headers, small values, strings, big values
+			if (r < 50)
+				size = workload_range(w, 16, 48);
+			else if (r < 80)
+				size = workload_range(w, 8, 128);
+			else if (r < 92)
+				size = workload_range(w, 129, 1024);
+			else if (r < 98)
+				size = workload_range(w, 1025, 16 * 1024);
+			else
+				size = workload_range(w, 16 * 1024 + 1, 512 * 1024);
+			break;
+
+		case WORKLOAD_SIZE_JSON:
+			//Object and array nodes, strings, member buffers
+			if (r < 45)
+				size = workload_range(w, 24, 64);
+			else if (r < 80)
+				size = (size_t)(8.0 * pow(workload_unit(w), -1.0 / 1.2));
+			else
+				size = workload_range(w, 64, 512);
+			break;
+
+		case WORKLOAD_SIZE_UNIFORM:
+		default:
+			size = workload_range(w, p->size_min, p->size_max);
+			break;
+	}
+
+	if (p->size_max != 0 && size > p->size_max)
+		size = p->size_max;
+
+	return (size == 0)? 1 : size;
+}
+
+/*
+ * Draws the number of operations an object lives
+ *
+ * @param struct workload * w, const struct workload_phase * p
+ * @return size_t
+ */
+size_t workload_lifetime_get(struct workload * w, const struct workload_phase * p)
+{
+	double mean = LIFETIME_SHORT;
+
+	switch (p->lifetime)
+	{
+		case WORKLOAD_LIFETIME_LONG:
+			return SIZE_MAX;
+
+		case WORKLOAD_LIFETIME_GENERATIONAL:
+			if (workload_random(w) % 100 < GENERATION_SURVIVE)
+				mean = LIFETIME_OLD;
+			break;
+
+		case WORKLOAD_LIFETIME_SHORT:
+		default:
+			break;
+	}
+
+	//Exponential, memoryless like most object deaths
+	return 1 + (size_t)(-log(workload_unit(w)) * mean);
+}
+
+/*
+ * Adds live slot to the death heap
+ *
+ * @param struct workload * w, size_t slot, size_t step
+ */
+void workload_death_push(struct workload * w, size_t slot, size_t step)
+{
+	size_t i = w->death_count++;
+	while (i > 0 && w->deaths[(i - 1) / 2].step > step)
+	{
+		w->deaths[i] = w->deaths[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+
+	w->deaths[i].step = step;
+	w->deaths[i].slot = slot;
+}
+
+/*
+ * Takes the slot that dies first from the death heap
+ *
+ * @param struct workload * w
+ * @return size_t slot
+ */
+size_t workload_death_pop(struct workload * w)
+{
+	size_t slot = w->deaths[0].slot;
+	struct workload_death last = w->deaths[--w->death_count];
+
+	size_t i = 0;
+	for (;;)
+	{
+		size_t c = i * 2 + 1;
+		if (c >= w->death_count)
+			break;
+		if (c + 1 < w->death_count && w->deaths[c + 1].step < w->deaths[c].step)
+			c++;
+		if (w->deaths[c].step >= last.step)
+			break;
+
+		w->deaths[i] = w->deaths[c];
+		i = c;
+	}
+
+	if (w->death_count > 0)
+		w->deaths[i] = last;
+
+	return slot;
+}
+
+/*
+ * Sets up a workload. Tables are allocated here so the run itself only calls
+ * the allocator under test.
+ *
+ * @param struct workload * w, const struct workload_config * config
+ * @return int 0 success, -1 fail
+ */
+int workload_init(struct workload * w, const struct workload_config * config)
+{
+	memset(w, 0, sizeof(struct workload));
+	w->config = *config;
+	w->random = (config->seed != 0)? config->seed : 1;
+
+	w->sizes = calloc(config->slots, sizeof(size_t));
+	w->slots_free = malloc(config->slots * sizeof(size_t));
+	w->deaths = malloc(config->slots * sizeof(struct workload_death));
+	if (w->sizes == NULL || w->slots_free == NULL || w->deaths == NULL)
+	{
+		workload_destroy(w);
+		return -1;
+	}
+
+	//Lowest slots are handed out first
+	for (size_t i = 0; i < config->slots; ++i)
+		w->slots_free[i] = config->slots - 1 - i;
+	w->slots_free_count = config->slots;
+
+	return 0;
+}
+
+/*
+ * Frees workload tables
+ *
+ * @param struct workload * w
+ */
+void workload_destroy(struct workload * w)
+{
+	free(w->sizes);
+	free(w->slots_free);
+	free(w->deaths);
+	w->sizes = NULL;
+	w->slots_free = NULL;
+	w->deaths = NULL;
+}
+
+/*
+ * Gives the next operation. Objects whose lifetime is over are freed first,
+ * when all phases are done the remaining objects are freed.
+ *
+ * @param struct workload * w, struct workload_op * op
+ * @return int 1 if op was set, 0 when the run is over
+ */
+int workload_next(struct workload * w, struct workload_op * op)
+{
+	while (w->phase < w->config.phase_count && w->phase_step >= w->config.phases[w->phase].steps)
+	{
+		w->phase++;
+		w->phase_step = 0;
+	}
+
+	bool done = (w->phase >= w->config.phase_count);
+	if (done && w->death_count == 0)
+		return 0;
+
+	const struct workload_phase * p = (done)? NULL : &w->config.phases[w->phase];
+	w->step++;
+	w->phase_step++;
+
+	//Dead, run over or no slot left
+	if (w->death_count > 0 && (done || w->deaths[0].step <= w->step || w->slots_free_count == 0))
+	{
+		op->call = WORKLOAD_FREE;
+		op->slot = workload_death_pop(w);
+		op->size = 0;
+		w->live_bytes -= w->sizes[op->slot];
+		w->sizes[op->slot] = 0;
+		w->slots_free[w->slots_free_count++] = op->slot;
+		return 1;
+	}
+
+	//Grow a live object
+	if (w->death_count > 0 && workload_random(w) % 100 < p->realloc_percent)
+	{
+		op->call = WORKLOAD_REALLOC;
+		op->slot = w->deaths[workload_random(w) % w->death_count].slot;
+
+		size_t size = w->sizes[op->slot];
+		size = (p->size == WORKLOAD_SIZE_JSON)? size * 2 : size + workload_size_get(w, p);
+		if (size > REALLOC_SIZE_MAX)
+			size = REALLOC_SIZE_MAX;
+
+		op->size = size;
+		w->live_bytes += size - w->sizes[op->slot];
+		w->sizes[op->slot] = size;
+		return 1;
+	}
+
+	op->call = WORKLOAD_MALLOC;
+	op->slot = w->slots_free[--w->slots_free_count];
+	op->size = workload_size_get(w, p);
+	w->live_bytes += op->size;
+	w->sizes[op->slot] = op->size;
+
+	size_t life = workload_lifetime_get(w, p);
+	workload_death_push(w, op->slot, (life > SIZE_MAX - w->step)? SIZE_MAX : w->step + life);
+	return 1;
+}
+
+/*
+ * Reads resident and peak resident bytes of this process
+ *
+ * @param size_t * rss, size_t * peak
+ */
+void workload_rss_get(size_t * rss, size_t * peak)
+{
+	*rss = 0;
+	*peak = 0;
+
+	#if defined(__linux)
+		//Read without stdio so the reading does not allocate
+		char text[4096];
+		int fd = open("/proc/self/status", O_RDONLY);
+		if (fd == -1)
+			return;
+
+		ssize_t length = read(fd, text, sizeof(text) - 1);
+		close(fd);
+		if (length <= 0)
+			return;
+		text[length] = '\0';
+
+		char * line = strstr(text, "VmHWM:");
+		if (line != NULL)
+			*peak = strtoull(line + 6, NULL, 10) * 1024;
+
+		line = strstr(text, "VmRSS:");
+		if (line != NULL)
+			*rss = strtoull(line + 6, NULL, 10) * 1024;
+	#endif
+}
+
+/*
+ * Starts a new peak, VmHWM is set back to the current rss where the kernel
+ * allows it (clear_refs, Linux 4.0)
+ *
+ * @return bool true if reset, false if VmHWM still holds the process peak
+ */
+bool workload_peak_reset(void)
+{
+	#if defined(__linux)
+		int fd = open("/proc/self/clear_refs", O_WRONLY);
+		if (fd == -1)
+			return false;
+
+		ssize_t length = write(fd, "5", 1);
+		close(fd);
+		return length == 1;
+	#else
+		return false;
+	#endif
+}
+
+/*
+ * Seconds on the monotonic clock
+ *
+ * @return double
+ */
+double workload_time(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)t.tv_sec + (double)t.tv_nsec / 1000000000.0;
+}
+
+/*
+ * Runs workload against allocator. Every allocation is touched once per page
+ * so it shows in rss.
+ *
+ * @param const struct workload_allocator * a, const struct workload_config * config,
+ *        struct workload_sample * samples, size_t sample_max
+ * @return size_t number of samples, 0 on fail
+ */
+size_t workload_run(const struct workload_allocator * a, const struct workload_config * config, struct workload_sample * samples, size_t sample_max)
+{
+	struct workload w;
+	if (workload_init(&w, config) != 0)
+		return 0;
+
+	void ** pointers = calloc(config->slots, sizeof(void *));
+	if (pointers == NULL)
+	{
+		workload_destroy(&w);
+		return 0;
+	}
+
+	size_t rss_start, peak_start;
+	workload_rss_get(&rss_start, &peak_start);
+
+	//Peak of the current phase, from VmHWM reset when the phase starts or else the highest rss sampled in it
+	size_t phase = SIZE_MAX;
+	size_t phase_peak = 0;
+	bool phase_hwm = false;
+
+	size_t every = (config->sample_every != 0)? config->sample_every : 1;
+	size_t count = 0;
+	size_t step_last = 0;
+	double time_start = workload_time();
+	double time_last = time_start;
+	struct workload_op op;
+
+	for (;;)
+	{
+		int more = workload_next(&w, &op);
+
+		if (w.phase != phase)
+		{
+			phase = w.phase;
+			phase_peak = 0;
+			phase_hwm = workload_peak_reset();
+		}
+
+		if (more && op.call == WORKLOAD_FREE)
+		{
+			a->free(pointers[op.slot]);
+			pointers[op.slot] = NULL;
+		}
+		else if (more)
+		{
+			void * addr = (op.call == WORKLOAD_REALLOC)? a->realloc(pointers[op.slot], op.size) : a->malloc(op.size);
+			if (addr == NULL)
+				break;
+
+			pointers[op.slot] = addr;
+			for (size_t i = 0; i < op.size; i += PAGE_TOUCH)
+				((volatile char *)addr)[i] = 1;
+			((volatile char *)addr)[op.size - 1] = 1;
+		}
+
+		if (count < sample_max && (!more || w.step % every == 0))
+		{
+			double now = workload_time();
+			struct workload_sample * s = &samples[count++];
+			size_t rss, peak;
+			workload_rss_get(&rss, &peak);
+			if (rss > phase_peak)
+				phase_peak = rss;
+			if (phase_hwm && peak > phase_peak)
+				phase_peak = peak;
+
+			s->phase = w.phase;
+			s->step = w.step;
+			s->seconds = now - time_start;
+			s->ops_per_sec = (now > time_last)? (double)(w.step - step_last) / (now - time_last) : 0;
+			s->rss = (rss > rss_start)? rss - rss_start : 0;
+			s->rss_peak = (phase_peak > rss_start)? phase_peak - rss_start : 0;
+			s->live_bytes = w.live_bytes;
+			s->fragmentation = (s->rss > s->live_bytes)? 1.0 - (double)s->live_bytes / (double)s->rss : 0;
+
+			time_last = now;
+			step_last = w.step;
+		}
+
+		if (!more)
+			break;
+	}
+
+	free(pointers);
+	workload_destroy(&w);
+	return count;
+}
+
+/*
+ * Runs workload against each allocator in its own process, so heaps and rss
+ * do not mix, and writes every sample as CSV or a JSON array.
+ *
+ * @param const struct workload_allocator * allocators, size_t count,
+ *        const struct workload_config * config, enum workload_format format, FILE * out
+ * @return int 0 success, -1 fail
+ */
+int workload_compare(const struct workload_allocator * allocators, size_t count, const struct workload_config * config, enum workload_format format, FILE * out)
+{
+	if (format == WORKLOAD_CSV)
+		fprintf(out, "allocator,phase,step,seconds,ops_per_sec,rss,rss_peak,live_bytes,fragmentation\n");
+	else
+		fprintf(out, "[");
+
+	int result = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		//Buffered output must not be written twice
+		fflush(out);
+
+		pid_t pid = fork();
+		if (pid == -1)
+			return -1;
+
+		if (pid == 0)
+		{
+			static struct workload_sample samples[SAMPLE_MAX];
+			size_t n = workload_run(&allocators[i], config, samples, SAMPLE_MAX);
+
+			if (format == WORKLOAD_JSON)
+				fprintf(out, "%s\n\t{\"allocator\": \"%s\", \"samples\": [", (i > 0)? "," : "", allocators[i].name);
+
+			for (size_t j = 0; j < n; ++j)
+			{
+				struct workload_sample * s = &samples[j];
+				if (format == WORKLOAD_CSV)
+					fprintf(out, "%s,%zu,%zu,%f,%.0f,%zu,%zu,%zu,%f\n",
+					        allocators[i].name, s->phase, s->step, s->seconds, s->ops_per_sec,
+					        s->rss, s->rss_peak, s->live_bytes, s->fragmentation);
+				else
+					fprintf(out, "%s\n\t\t{\"phase\": %zu, \"step\": %zu, \"seconds\": %f, \"ops_per_sec\": %.0f, "
+					             "\"rss\": %zu, \"rss_peak\": %zu, \"live_bytes\": %zu, \"fragmentation\": %f}",
+					        (j > 0)? "," : "", s->phase, s->step, s->seconds, s->ops_per_sec,
+					        s->rss, s->rss_peak, s->live_bytes, s->fragmentation);
+			}
+
+			if (format == WORKLOAD_JSON)
+				fprintf(out, "\n\t]}");
+
+			fflush(out);
+			_exit((n > 0)? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+
+		int status;
+		if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+			result = -1;
+	}
+
+	if (format == WORKLOAD_JSON)
+		fprintf(out, "\n]\n");
+
+	fflush(out);
+	return result;
+}
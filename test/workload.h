@@ -0,0 +1,125 @@
+/* General Purpose Memory Allocator (gpmalloc)
+ * workload.h
+ *
+ * Copyright (C) 2018
+ * All Rights Reserved
+ */
+
+#ifndef GPMALLOC_WORKLOAD_H
+#define GPMALLOC_WORKLOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+//Size distributions
+enum workload_size
+{
+	WORKLOAD_SIZE_UNIFORM, //size_min to size_max
+	WORKLOAD_SIZE_POWER_LAW, //Pareto from size_min with exponent alpha, cut at size_max
+	WORKLOAD_SIZE_BIMODAL, //Mostly size_min to 4 * size_min, the rest size_max / 2 to size_max
+	WORKLOAD_SIZE_REDIS, //Keys, small values and a tail of large values, cut at size_max
+	WORKLOAD_SIZE_JSON //Nodes, short strings and buffers that double on realloc, cut at size_max
+};
+
+//Object lifetimes, counted in operations
+enum workload_lifetime
+{
+	WORKLOAD_LIFETIME_SHORT, //Freed after ~16 operations
+	WORKLOAD_LIFETIME_GENERATIONAL, //90% die young, the rest live ~16K operations
+	WORKLOAD_LIFETIME_LONG //Live until the slot table is full or the run ends
+};
+
+enum workload_call
+{
+	WORKLOAD_MALLOC,
+	WORKLOAD_FREE,
+	WORKLOAD_REALLOC
+};
+
+//Part of a run, phases follow each other and objects outlive their phase
+struct workload_phase
+{
+	enum workload_size size;
+	enum workload_lifetime lifetime;
+	size_t steps; //Operations, frees included
+	size_t size_min;
+	size_t size_max;
+	double alpha; //Power law exponent
+	unsigned int realloc_percent; //Allocations that resize a live object instead
+};
+
+struct workload_config
+{
+	const struct workload_phase * phases;
+	size_t phase_count;
+	size_t slots; //Most live objects
+	uint64_t seed;
+	size_t sample_every; //Operations between samples
+};
+
+//Operation on a slot. Malloc is only given for empty slots, free and realloc only for live ones
+struct workload_op
+{
+	enum workload_call call;
+	size_t slot;
+	size_t size; //New size for malloc and realloc
+};
+
+//Live object ordered by the step it dies at
+struct workload_death
+{
+	size_t step;
+	size_t slot;
+};
+
+struct workload
+{
+	struct workload_config config;
+	size_t phase;
+	size_t phase_step;
+	size_t step;
+	uint64_t random;
+	size_t live_bytes;
+	size_t * sizes; //Size per slot, 0 if empty
+	size_t * slots_free;
+	size_t slots_free_count;
+	struct workload_death * deaths; //Min heap, holds every live slot
+	size_t death_count;
+};
+
+//Allocator under test
+struct workload_allocator
+{
+	const char * name;
+	void * (*malloc)(size_t);
+	void (*free)(void *);
+	void * (*realloc)(void *, size_t);
+};
+
+//Point in a run, rss values are growth since the run started, rss_peak is the highest rss of the sample's phase
+struct workload_sample
+{
+	size_t phase;
+	size_t step;
+	double seconds;
+	double ops_per_sec; //Since the last sample
+	size_t rss;
+	size_t rss_peak;
+	size_t live_bytes; //Bytes asked for and not yet freed
+	double fragmentation; //1 - live_bytes / rss
+};
+
+enum workload_format
+{
+	WORKLOAD_CSV,
+	WORKLOAD_JSON
+};
+
+int workload_init(struct workload *, const struct workload_config *);
+void workload_destroy(struct workload *);
+int workload_next(struct workload *, struct workload_op *);
+size_t workload_run(const struct workload_allocator *, const struct workload_config *, struct workload_sample *, size_t);
+int workload_compare(const struct workload_allocator *, size_t, const struct workload_config *, enum workload_format, FILE *);
+
+#endif //GPMALLOC_WORKLOAD_H